@@ -41,6 +41,23 @@
 						  Changed Farnsworth setting mode to play continuous DIT-DAH when not holding paddle to adjust, like Pitch command
 						  Changed Version command to return to command mode instead of normal mode if interrupted with command key
 						  Changed speed inquiry command to return to command mode instead of normal mode if interrupted with command key
+ @date      18.10.2026  - Added operator profiles. "O" followed by a profile number loads a complete set of settings, "H" followed by
+                          a profile number stores the current settings.
+                          Several commands can be keyed as one word and are acknowledged once. Commands were moved from
+                          commandmode() into a command table in Flash, looked up by command().
+                          "G" resets the learned gaps of the adaptive decoder (ADAPTIVE).
+                          "Y" edits a message in place (append a word, replace the last word or truncate).
+                          "Q" reads back lifetime usage counters (TELEMETRY).
+                          "=" sets PTT lead, tail and hang time (PTTOUT).
+                          "/" selects the radio in focus (SO2R).
+                          "J" replays the last word, the last characters or the last message sent (HISTORY).
+                          "?" reads back statistics about the paddle timing of the operator (ANALYZER).
+                          The power on greeting is played at GREETWPM and ends on the first paddle contact.
+                          The beacon interval is kept in a key/value settings store instead of the user words.
+                          The TX line can be keyed by timer hardware on exact heartbeat boundaries (HWKEY).
+                          Background tasks run from yackbeat. The beacon keeps counting in command mode.
+                          The idle main loop can sleep through heartbeats until the next deadline (TICKLESS).
+                          "!" reads back the worst heartbeat load and where it happened (BEATWATCH).
  */ 
 
 
@@ -57,6 +74,23 @@
 #define		TRAINTIMEOUT	10      // 10 Seconds
 #define		PITCHREPEAT		10		// 10 e's will be played for pitch adjust
 #define     FARNSREPEAT     10      // 10 a's will be played for Farnsworth
+#define     CMDBATCH        16      // Longest command word that can be keyed
+#define     NONUMBER        0xFFFF  // No number was keyed
+
+// Results of a command
+#define     CMDFAIL         0       // Unknown, locked or failed command
+#define     CMDACK          1       // Done, acknowledge with txok
+#define     CMDQUIET        2       // Done, no acknowledgment (macro playback)
+#define     CMDLOCK         0x80    // Command table flag: blocked by configuration lock
+
+// Entry of the command table
+struct command
+{
+    char    letter;                 // Command character
+    byte    (*handler)(byte arg);   // Called to carry out the command
+    byte    arg;                    // Argument passed to the handler
+    byte    flags;                  // CMDLOCK and post action (CMDACK or CMDQUIET)
+};
 
 // Some texts in Flash used by the application
 const char  txok[] PROGMEM 		= "R";
@@ -64,6 +98,16 @@ const char  vers[] PROGMEM      = "V0.87";
 const char  prgx[] PROGMEM 		= "#"; // # decodes to prosign SK with no intercharacter gap
 const char  imok[] PROGMEM		= "73";
 
+// Beacon
+static word	interval;			// Beacon interval in seconds (0 = off)
+static word	beaconleft;			// Seconds until the beacon is due
+static byte	beacondue;			// Set when the beacon should play
+
+// Command batch (several commands keyed as one word)
+static char	cmdbuf[CMDBATCH];	// Commands keyed in the current word
+static byte	cmdlen;				// Number of commands in cmdbuf
+static byte	cmdpos;				// Next command to execute
+
 void pitch(void)
 /*! 
  @brief     Pitch change mode
@@ -106,8 +150,8 @@ void setfarns(void)
 /*! 
  @brief     Farnsworth change mode
  
- This function implements farnsworth pause change mode. Farnsworth pauses can be added or removed
- with the paddle keys.
+ This function implements farnsworth speed change mode. The overall speed can be lowered 
+ or raised with the paddle keys.
  
  */
 {
@@ -126,13 +170,13 @@ void setfarns(void)
         
 		if(!(KEYINP & (1<<DITPIN))) // if DIT was keyed
 	  	{
-	  		yackspeed(DOWN,FARNSWORTH);		// increase interword spacing
+	  		yackspeed(DOWN,FARNSWORTH);		// lower overall speed
 	  		timer=0;
 	  	}
 		
 		else if(!(KEYINP & (1<<DAHPIN))) // if DAH was keyed
 	  	{
-	  		yackspeed(UP,FARNSWORTH);	// decrease interword spacing
+	  		yackspeed(UP,FARNSWORTH);	// raise overall speed
 	  		timer=0;
 	  	}
 	  
@@ -211,12 +255,13 @@ void cstrain(void)
  sounded, the callsign sent again and the user attempts one more time.
  */
 {
-	char	call[5]; 	// A buffer to store the callsign
+	char	call[6]; 	// A buffer to store the callsign
 	char	c;			// The character returned by IAMBIC keyer
 	byte	i;			// Counter
-	byte	n;			// Playback counter
 	word	timer;		// Timeout timer
 	
+	call[5] = '\0';		// rndcall fills in the first 5 characters
+	
 	while(1)	// Endless loop will exit throught RETURN statement only
 		
 	{
@@ -229,13 +274,9 @@ void cstrain(void)
             if (!i) // If nothing guessed yet, play the callsign
 			{
 				yackdelay(2 * IWGLEN); // Give him some time to breathe b4 next callsign
-				for (n=0;n<5;n++)
-                {    
-					yackchar(call[n]);
-                    yackfarns(); // Add potential farnsworth delays
-                    if(yackctrlkey(TRUE)) 
-                        return; // Abort if requested..
-                }
+				yacksend(SRCRAM, call);
+                if(yackctrlkey(TRUE)) 
+                    return; // Abort if requested..
 			}
 			
 			timer = YACKSECS(TRAINTIMEOUT);
@@ -269,14 +310,93 @@ void cstrain(void)
 
 
 
+char cmdarg(char prompt)
+/*! 
+ @brief     Reads the argument of a command
+ 
+ Used by commands that need an argument (e.g. a profile number). If the command was
+ keyed as part of a batch, the next character of the batch is used. Otherwise the prompt
+ is played and the routine waits up to DEFTIMEOUT seconds for a character to be keyed.
+ 
+ @param prompt  The character to play when the argument must be keyed separately (\0 for none)
+ @return        The argument or \0 on timeout or command key press
+ */
+{
+	word	timer = YACKSECS(DEFTIMEOUT);
+	char	c = '\0';
+	
+	if (cmdpos < cmdlen)
+		return cmdbuf[cmdpos++];
+	
+	if (prompt)
+		yackchar(prompt);
+	
+	while (!c && timer-- && !yackctrlkey(TRUE))
+	{
+		c = yackiambic(OFF);
+		yackbeat();
+	}
+	
+	return c;
+}
+
+
+
+word cmdnum(char prompt)
+/*! 
+ @brief     Reads a numerical argument of a command
+ 
+ Reads decimal digits with cmdarg. Within a batch the number ends with the last digit,
+ otherwise with a timeout of DEFTIMEOUT seconds.
+ 
+ @param prompt  The character to play when the number must be keyed separately
+ @return        The number or NONUMBER if no digit was keyed
+ */
+{
+	word	n = NONUMBER;
+	byte	batch = (cmdpos < cmdlen);
+	char	c = cmdarg(prompt);
+	
+	while (c >= '0' && c <= '9')
+	{
+		n = ((n == NONUMBER) ? 0 : n * 10) + c - '0';
+		
+		if (batch && (cmdpos == cmdlen || cmdbuf[cmdpos] < '0' || cmdbuf[cmdpos] > '9'))
+			break; // No more digits in batch
+		
+		c = cmdarg('\0');
+	}
+	
+	return n;
+}
+
+
+
+void beacontask(void)
+/*! 
+ @brief     Beacon countdown
+ 
+ Called once a second as a background task by yackbeat, so the beacon keeps its interval
+ while the keyer is in command mode or playing a message. It only flags the beacon as due,
+ playing it is left to beacon(PLAY) in the main loop.
+ 
+*/
+{
+	if (beaconleft && !--beaconleft) // Interval over?
+		beacondue = TRUE;
+}
+
+
+
 void beacon(byte mode)
 /*! 
  @brief     Beacon mode
  
  This routine can read a beacon transmission interval up to 
- 9999 seconds and store it in EEPROM (RECORD mode)
+ 9999 seconds and store it in EEPROM (RECORD mode). A longer interval
+ is rejected with the error prosign and the previous one is kept.
  In PLAY mode, when called in the YACKBEAT loop, it plays back
- message 2 in the programmed interval
+ message 4 once beacontask has found the interval to be over
  
  @param mode RECORD (read and store the beacon interval) or PLAY (beacon)
 
@@ -285,14 +405,9 @@ void beacon(byte mode)
 */
 {
 
-	static word interval = 65000; // A dummy value that can not be reached
-	static word timer;
+	word timer;
 	char c;
 
-	
-	if (interval == 65000) // 
-		interval = yackuser(READ, 1, 0);	
-	
 	if (mode == RECORD)
 	{
 		interval = 0; // Reset previous settings
@@ -315,14 +430,20 @@ void beacon(byte mode)
 		
 		if (interval >= 0 && interval <= 9999)
 		{
-			yackuser(WRITE, 1, interval); // Record interval
+			yackset(KVBEACON, interval); // Record interval
 			yacknumber(interval); // Playback number
+			
+			beaconleft = interval; // Start counting from now
+			beacondue = FALSE;
 		}
 		else 
 		{
 			yackerror();
+			interval = yackget(KVBEACON); // Keep the previous interval running
 		}
 		
+		yacktask(beacontask, interval ? YACKSECS(1) : 0); // No need to tick while off
+		
 	}
 
 	
@@ -338,29 +459,496 @@ void beacon(byte mode)
         
 #endif
         
-		if (timer) timer--; // Countdown until a second has expired
-		else 
+		if (beacondue)
 		{
-			timer = YACKSECS(1); // Reset timer
-			
-			if ((--interval)==0) // Interval was > 0. Did decrement bring it to 0?
-			{
-
-				interval = yackuser(READ, 1, 0); // Reset the interval timer
-				yackmessage(PLAY,4); // And play message 4
-
-				
-			} 
-			
+			beacondue = FALSE;
+			beaconleft = interval; // Next interval starts with this playback
+			yackmessage(PLAY,4); // And play message 4
 		}
 				
 	}
+
 	
 }
 
 
 
 
+// Command handlers. Each one is called with the argument from its command table
+// entry and returns TRUE if the command was carried out.
+
+byte cmdreset(byte arg)
+/*! 
+ @brief     R: Resets all settings to their defaults
+ 
+ @param arg     Not used
+ @return        Always TRUE
+ */
+{
+    yackreset();
+    return TRUE;
+}
+
+byte cmdmode(byte mode)
+/*! 
+ @brief     A, B, L, D: Selects the keyer mode
+ 
+ @param mode    IAMBICA, IAMBICB, ULTIMATIC or DAHPRIO
+ @return        Always TRUE
+ */
+{
+    yackmode(mode);
+    return TRUE;
+}
+
+byte cmdtoggle(byte flag)
+/*! 
+ @brief     X, S, K, F, 0: Toggles a setting
+ 
+ @param flag    The flag in yackflags to toggle
+ @return        Always TRUE
+ */
+{
+    yacktoggle(flag);
+    return TRUE;
+}
+
+byte cmdfarns(byte arg)
+/*! 
+ @brief     Z: Reads and sets the Farnsworth speed
+ 
+ @param arg     Not used
+ @return        Always TRUE
+ */
+{
+    setfarns();
+    return TRUE;
+}
+
+byte cmdrecord(byte msgnr)
+/*! 
+ @brief     1 to 4: Records a message
+ 
+ @param msgnr   1 or 2 or 3 or 4
+ @return        Always TRUE
+ */
+{
+    yackchar('0' + msgnr);
+    yackmessage(RECORD, msgnr);
+    return TRUE;
+}
+
+byte cmdbeacon(byte arg)
+/*! 
+ @brief     N: Reads and stores the beacon interval
+ 
+ @param arg     Not used
+ @return        Always TRUE
+ */
+{
+    beacon(RECORD);
+    return TRUE;
+}
+
+byte cmdprofile(byte func)
+/*! 
+ @brief     O, H: Loads or stores an operator profile
+ 
+ The profile number is taken from the batch or keyed after the prompt.
+ 
+ @param func    READ to load, WRITE to store
+ @return        TRUE if all was OK, FALSE if not
+ */
+{
+    return yackprofile(func, cmdarg(func == READ ? 'O' : 'H') - '0');
+}
+
+byte cmdedit(byte arg)
+/*! 
+ @brief     Y: Edits a stored message
+ 
+ Reads the message number and then A (append a word), W (replace the last word) or T
+ followed by the number of characters to keep.
+ 
+ @param arg     Not used
+ @return        TRUE if all was OK, FALSE if not
+ */
+{
+    byte    msgnr = cmdarg('Y') - '0';
+    word    pos;
+    
+    if (msgnr < 1 || msgnr > 4)
+        return FALSE;
+    
+    switch (cmdarg('0' + msgnr))
+    {
+        case 'A': // Append a word
+            yackchar('A');
+            yackmessage(APPEND, msgnr);
+            return TRUE;
+            
+        case 'W': // Replace the last word
+            yackchar('W');
+            yackmessage(REPLACE, msgnr);
+            return TRUE;
+            
+        case 'T': // Truncate
+            pos = cmdnum('T');
+            return (pos < RBSIZE) && yacktruncate(msgnr, pos);
+    }
+    
+    return FALSE;
+}
+
+#ifdef PTTOUT
+byte cmdptt(byte arg)
+/*! 
+ @brief     =: Sets a PTT time
+ 
+ Reads L (lead), T (tail) or H (hang) followed by the new value.
+ 
+ @param arg     Not used
+ @return        TRUE if all was OK, FALSE if not
+ */
+{
+    char    p = cmdarg('=');
+    word    n;
+    
+    if (p != 'L' && p != 'T' && p != 'H')
+        return FALSE;
+    
+    n = cmdnum(p);
+    
+    if (n == NONUMBER)
+        return FALSE;
+    
+    return yackptt((p == 'L') ? PTTLEAD : (p == 'T') ? PTTTAIL : PTTHANG, n);
+}
+#endif
+
+#ifdef HISTORY
+byte cmdreplay(byte arg)
+/*! 
+ @brief     J: Replays sent text
+ 
+ Reads W (last word), M (last message) or the number of characters to replay. Replay
+ goes on air, so the keyer is enabled while it plays.
+ 
+ @param arg     Not used
+ @return        TRUE if all was OK, FALSE if not
+ */
+{
+    byte    batch = (cmdpos < cmdlen);
+    char    c = cmdarg('J');
+    char    what = c;
+    word    n = 0;
+    byte    ok;
+    
+    while (c >= '0' && c <= '9') // Number of characters
+    {
+        n = n * 10 + c - '0';
+        
+        if (n > HISTSIZE)
+            n = HISTSIZE;
+        
+        if (batch && (cmdpos == cmdlen || cmdbuf[cmdpos] < '0' || cmdbuf[cmdpos] > '9'))
+            break; // No more digits in batch
+        
+        c = cmdarg('\0');
+    }
+    
+    if (!n && what != 'W' && what != 'M')
+        return FALSE;
+    
+    yackinhibit(OFF);
+    ok = yackreplay((what == 'W') ? LASTWORD : (what == 'M') ? LASTMSG : LASTCHARS, n);
+    yackinhibit(ON);
+    
+    return ok;
+}
+#endif
+
+#ifdef SO2R
+byte cmdradio(byte arg)
+/*! 
+ @brief     /: Selects the radio in focus
+ 
+ @param arg     Not used
+ @return        TRUE if all was OK, FALSE if not
+ */
+{
+    return yackradio(cmdarg('/') - '0');
+}
+#endif
+
+#ifdef ADAPTIVE
+byte cmdgaps(byte arg)
+/*! 
+ @brief     G: Forgets the learned gaps
+ 
+ @param arg     Not used
+ @return        Always TRUE
+ */
+{
+    yackgaps();
+    return TRUE;
+}
+#endif
+
+byte cmdversion(byte arg)
+/*! 
+ @brief     V: Plays the software version
+ 
+ @param arg     Not used
+ @return        Always TRUE
+ */
+{
+    yackstring(vers);
+    return TRUE;
+}
+
+byte cmdpitch(byte arg)
+/*! 
+ @brief     P: Adjusts the sidetone pitch
+ 
+ @param arg     Not used
+ @return        Always TRUE
+ */
+{
+    pitch();
+    return TRUE;
+}
+
+byte cmdtune(byte arg)
+/*! 
+ @brief     U: Keys the transmitter for tuning
+ 
+ @param arg     Not used
+ @return        Always TRUE
+ */
+{
+    yackinhibit(OFF);
+    yacktune();
+    yackinhibit(ON); 
+    return TRUE;
+}
+
+byte cmdtrain(byte arg)
+/*! 
+ @brief     C: Starts callsign training
+ 
+ @param arg     Not used
+ @return        Always TRUE
+ */
+{
+    cstrain();
+    return TRUE;
+}
+
+byte cmdplay(byte msgnr)
+/*! 
+ @brief     E, I, T, M: Plays a message on air
+ 
+ @param msgnr   1 or 2 or 3 or 4
+ @return        Always TRUE
+ */
+{
+    yackinhibit(OFF);
+    yackmessage(PLAY, msgnr);
+    yackinhibit(ON);
+    return TRUE;
+}
+
+byte cmdwpm(byte arg)
+/*! 
+ @brief     W: Plays the current speed in WPM
+ 
+ @param arg     Not used
+ @return        Always TRUE
+ */
+{
+    yacknumber(yackwpm());
+    return TRUE;
+}
+
+#ifdef TELEMETRY
+byte cmdcounter(byte arg)
+/*! 
+ @brief     Q: Plays a usage counter
+ 
+ Reads the counter number. The key down time is played in seconds. The counters
+ are written to EEPROM first, so a query also saves them.
+ 
+ @param arg     Not used
+ @return        TRUE if all was OK, FALSE if not
+ */
+{
+    word    nr = cmdnum('Q');
+    
+    if (nr >= TELCOUNT)
+        return FALSE;
+    
+    yackcountsave(); // Keep what we are about to report
+    
+    if (nr == TELKEYDOWN) // Key down time in seconds
+        yacknumber(yackcounter(nr) / YACKSECS(1));
+    else
+        yacknumber(yackcounter(nr));
+    
+    return TRUE;
+}
+#endif
+
+
+
+#ifdef ANALYZER
+byte cmdstats(byte arg)
+/*! 
+ @brief     ?: Plays a paddle timing statistic
+ 
+ Reads the number of the statistic.
+ 
+ @param arg     Not used
+ @return        TRUE if all was OK, FALSE if not
+ */
+{
+    word    nr = cmdnum('?');
+    
+    if (nr >= ANACOUNT)
+        return FALSE;
+    
+    yacknumber(yackstats(nr));
+    
+    return TRUE;
+}
+#endif
+
+
+
+#ifdef BEATWATCH
+byte cmdload(byte arg)
+/*! 
+ @brief     !: Plays a heartbeat load figure
+ 
+ Reads the number of the figure.
+ 
+ @param arg     Not used
+ @return        TRUE if all was OK, FALSE if not
+ */
+{
+    word    nr = cmdnum('!');
+    
+    if (nr >= BEATSTAGE + STAGES)
+        return FALSE;
+    
+    yacknumber(yackload(nr));
+    
+    return TRUE;
+}
+#endif
+
+
+
+//! Command table in Flash. Adding a command takes one line here.
+//! Lockable commands are refused while the configuration is locked.
+
+const struct command cmdtable[] PROGMEM = 
+{
+    { 'R', cmdreset,    0,          CMDLOCK | CMDACK },     // Reset
+    { 'A', cmdmode,     IAMBICA,    CMDLOCK | CMDACK },     // IAMBIC A
+    { 'B', cmdmode,     IAMBICB,    CMDLOCK | CMDACK },     // IAMBIC B
+    { 'L', cmdmode,     ULTIMATIC,  CMDLOCK | CMDACK },     // ULTIMATIC
+    { 'D', cmdmode,     DAHPRIO,    CMDLOCK | CMDACK },     // DAHPRIO
+    { 'X', cmdtoggle,   PDLSWAP,    CMDLOCK | CMDACK },     // Paddle swapping
+    { 'S', cmdtoggle,   SIDETONE,   CMDLOCK | CMDACK },     // Sidetone toggle
+    { 'K', cmdtoggle,   TXKEY,      CMDLOCK | CMDACK },     // TX keying toggle
+    { 'Z', cmdfarns,    0,          CMDLOCK | CMDACK },     // Farnsworth speed
+    { 'F', cmdtoggle,   TXINV,      CMDLOCK | CMDACK },     // TX level inverter toggle
+    { '1', cmdrecord,   1,          CMDLOCK | CMDACK },     // Record Macro 1
+    { '2', cmdrecord,   2,          CMDLOCK | CMDACK },     // Record Macro 2
+    { '3', cmdrecord,   3,          CMDLOCK | CMDACK },     // Record Macro 3
+    { '4', cmdrecord,   4,          CMDLOCK | CMDACK },     // Record Macro 4
+    { 'N', cmdbeacon,   0,          CMDLOCK | CMDACK },     // Automatic Beacon
+    { 'Y', cmdedit,     0,          CMDLOCK | CMDACK },     // Edit Macro
+    { 'O', cmdprofile,  READ,       CMDLOCK | CMDACK },     // Load operator profile
+    { 'H', cmdprofile,  WRITE,      CMDLOCK | CMDACK },     // Hold settings in profile
+#ifdef PTTOUT
+    { '=', cmdptt,      0,          CMDLOCK | CMDACK },     // PTT timing
+#endif
+#ifdef ADAPTIVE
+    { 'G', cmdgaps,     0,          CMDLOCK | CMDACK },     // Forget learned gaps
+#endif
+    { 'V', cmdversion,  0,          CMDACK },               // Version
+    { 'P', cmdpitch,    0,          CMDACK },               // Pitch
+    { 'U', cmdtune,     0,          CMDACK },               // Tune
+    { 'C', cmdtrain,    0,          CMDACK },               // Callsign training
+    { '0', cmdtoggle,   CONFLOCK,   CMDACK },               // Lock changes
+    { 'E', cmdplay,     1,          CMDQUIET },             // Playback Macro 1
+    { 'I', cmdplay,     2,          CMDQUIET },             // Playback Macro 2
+    { 'T', cmdplay,     3,          CMDQUIET },             // Playback Macro 3
+    { 'M', cmdplay,     4,          CMDQUIET },             // Playback Macro 4
+    { 'W', cmdwpm,      0,          CMDACK },               // Query WPM
+#ifdef HISTORY
+    { 'J', cmdreplay,   0,          CMDQUIET },             // Replay sent text
+#endif
+#ifdef SO2R
+    { '/', cmdradio,    0,          CMDACK },               // Select radio
+#endif
+#ifdef TELEMETRY
+    { 'Q', cmdcounter,  0,          CMDACK },               // Query usage counter
+#endif
+#ifdef ANALYZER
+    { '?', cmdstats,    0,          CMDACK },               // Query paddle timing statistics
+#endif
+#ifdef BEATWATCH
+    { '!', cmdload,     0,          CMDACK },               // Query heartbeat load
+#endif
+};
+
+
+
+byte command(char c)
+/*! 
+ @brief     Executes a single command
+ 
+ Looks up one character keyed in command mode in the command table and calls its
+ handler. Arguments that a command needs (e.g. a profile number) are taken from the 
+ rest of the batch with cmdarg.
+ 
+ @param c   The command character
+ @return    CMDACK if the command needs acknowledging, CMDQUIET if not, CMDFAIL on error
+ 
+*/
+{
+	
+	byte	i;
+	byte	flags;
+	byte	(*handler)(byte);
+	
+	for (i = 0; i < sizeof(cmdtable) / sizeof(cmdtable[0]); i++)
+	{
+		if (pgm_read_byte(&cmdtable[i].letter) != c)
+			continue;
+		
+		flags = pgm_read_byte(&cmdtable[i].flags);
+		
+		if ((flags & CMDLOCK) && yackflag(CONFLOCK)) // Locked configuration command?
+			break;
+		
+		handler = (byte (*)(byte)) pgm_read_word(&cmdtable[i].handler);
+		
+		if (handler(pgm_read_byte(&cmdtable[i].arg)))
+			return (flags & ~CMDLOCK); // Post action (CMDACK or CMDQUIET)
+		
+		break;
+	}
+    
+    return CMDFAIL; // Unknown, locked or failed command
+    
+}
+
+
+
 void commandmode(void)
 /*! 
  @brief     Command mode
@@ -368,195 +956,94 @@ void commandmode(void)
  This routine implements command mode. Entries are read from the paddle
  and interpreted as commands.
  
+ Several commands can be keyed as one word (e.g. "BSX"). They are executed in order once
+ the word gap is detected, followed by a single save and a single acknowledgment. If a 
+ command fails, the rest of the word is skipped and the error prosign is sounded, followed 
+ by the position of the failing command if the word had more than one. A word longer
+ than CMDBATCH characters is dropped as a whole with the error prosign.
+ 
 */
 {
 	
 	char 	c;				// Character from Morse key
     word    timer;          // Exit timer
+    byte    ack;            // Acknowledgment needed after batch
+    byte    result;         // Result of the last command
+    byte    failpos = 0;    // Where the last command started in the batch
+    byte    discard = FALSE; // Drop the rest of an overlong word
 	
 	yackinhibit(ON); 		// Sidetone = on, Keyer = off
 	
+#ifdef TELEMETRY
+	
+	yackcount(TELCMDMODE);
+	
+#endif
+	
 	yackchar('?'); 			// Play Greeting
 	
     timer = YACKSECS(DEFTIMEOUT); // Time out after 10 seconds
+    cmdlen = 0;
     
     while ((yackctrlkey(TRUE)==0) && (timer-- > 0))
 	{
 		
-		c=yackiambic(OFF);
+		c=yackiambic(ON);
         if (c) timer = YACKSECS(DEFTIMEOUT); // Reset timeout if character read
         
 		yackbeat();
         
         lfsr(255);          // Keep seeding the LFSR so we get different callsigns
 		
-        if (!yackflag(CONFLOCK)) // No Configuration lock?
-        {    
-            switch (c) // These are the lockable configuration commands
+        if (c == ' ') // A word gap ends any discarding
+            discard = FALSE;
+        else if (c && !discard) // Collect the command word
+        {
+            if (cmdlen == CMDBATCH) // Too long? Drop the whole word
             {
-                    
-                case	'R': // Reset
-                    yackreset();
-                    c = TRUE;
-                    break;
-                    
-                case	'A': // IAMBIC A
-                    yackmode(IAMBICA);
-                    c = TRUE;
-                    break;
-                    
-                case	'B': // IAMBIC B
-                    yackmode(IAMBICB);
-                    c = TRUE;
-                    break;
-
-                case	'L': // ULTIMATIC
-                    yackmode(ULTIMATIC);
-                    c = TRUE;
-                    break;
-                    
-                case    'D': // DAHPRIO
-                    yackmode(DAHPRIO);
-                    c = TRUE;
-                    break;
-                    
-                case	'X': // Paddle swapping
-                    yacktoggle(PDLSWAP);
-                    c = TRUE;
-                    break;
-                    
-                case    'S': // Sidetone toggle
-                    yacktoggle(SIDETONE);
-                    c = TRUE;
-                    break;
-                    
-                case    'K': // TX keying toggle
-                    yacktoggle(TXKEY);
-                    c = TRUE;
-                    break;
-                    
-                case    'Z': // Farnsworth pause
-                    setfarns();
-                    c = TRUE;
-                    break;
-                        
-                case    'F': // TX level inverter toggle
-                    yacktoggle(TXINV);
-                    c = TRUE;
-                    break;
-                    
-                case	'1': // Record Macro 1
-                    yackchar('1');
-                    yackmessage(RECORD,1); 
-                    c = TRUE;
-                    break;
-                    
-                case	'2': // Record Macro 2
-                    yackchar('2');
-                    yackmessage(RECORD,2); 
-                    c = TRUE;
-                    break;
-					
-				case	'3': // Record Macro 3
-                    yackchar('3');
-                    yackmessage(RECORD,3); 
-                    c = TRUE;
-                    break;
-
-				case	'4': // Record Macro 4
-                    yackchar('4');
-                    yackmessage(RECORD,4); 
-                    c = TRUE;
-                    break;	
-                    
-                case	'N': // Automatic Beacon
-                    beacon(RECORD);
-                    c = TRUE;
-                    break;
-                    
+                yackerror();
+                cmdlen = 0;
+                discard = TRUE;
             }
-            
+            else
+                cmdbuf[cmdlen++] = c;
         }
         
-        switch (c) // Commands that can be used anytime
+        if (c != ' ' || !cmdlen) // Execute once the word has ended
+            continue;
+        
+        ack = FALSE;
+        result = CMDACK;
+        
+        for (cmdpos = 0; cmdpos < cmdlen && !yackctrlkey(FALSE); )
         {
-                
-            case    'V': // Version
-                yackstring(vers);
-                c = TRUE;
-                break;
-    
-                
-            case	'P': // Pitch
-                pitch();
-                c = TRUE;
-                break;
-                
-            case	'U': // Tune
-                yackinhibit(OFF);
-                yacktune();
-                yackinhibit(ON); 
-                c = TRUE;
-                break;
-                
-            case	'C': // Callsign training
-                cstrain();
-                c = TRUE;
-                break;
-                
-            case    '0': // Lock changes
-                yacktoggle(CONFLOCK);
-                c = TRUE;
-                break;
-                
-            case	'E': // Playback Macro 1
-                yackinhibit(OFF);
-                yackmessage(PLAY,1);
-                yackinhibit(ON);
-                timer = YACKSECS(MACTIMEOUT);
-                c = FALSE;
-                break;
-                
-            case	'I': // Playback Macro 2
-                yackinhibit(OFF);
-                yackmessage(PLAY,2);
-                yackinhibit(ON);
-                timer = YACKSECS(MACTIMEOUT);
-                c = FALSE;
+            failpos = cmdpos; // The command itself may consume arguments
+            result = command(cmdbuf[cmdpos++]);
+            
+            if (result == CMDFAIL)
                 break;
-				
-			case	'T': // Playback Macro 3
-                yackinhibit(OFF);
-                yackmessage(PLAY,3);
-                yackinhibit(ON);
-                timer = YACKSECS(MACTIMEOUT);
-                c = FALSE;
-                break;	
-				
-			case	'M': // Playback Macro 4
-                yackinhibit(OFF);
-                yackmessage(PLAY,4);
-                yackinhibit(ON);
+            
+            if (result == CMDACK)
+                ack = TRUE;
+            else // Macro playback
                 timer = YACKSECS(MACTIMEOUT);
-                c = FALSE;
-                break;	
-                
-            case    'W': // Query WPM
-                yacknumber(yackwpm());
-                c = TRUE;
-                break;
-                
-                
         }
         
-        if (c == TRUE) // If c still contains a string, the command was not handled properly
+        yacksave(); //Save any non-volatile changes to EEPROM
+        
+        if (result == CMDFAIL)
+        {
+            yackerror();
+            if (cmdlen > 1) // Name the failing command in a batch
+                yacknumber(failpos + 1);
+        }
+        else if (ack)
 		{
-			yacksave(); //Save any non-volatile changes to EEPROM
 			yackdelay(DAHLEN * 3); //Eliminate runon txok on some commands
             yackstring(txok);
 		}
-        else if (c)
-            yackerror();    
+        
+        cmdlen = 0;
             
 	}
         
@@ -582,9 +1069,14 @@ int main(void)
 	
 	yackinit(); 					// Initialize YACK hardware
 	
+	interval = beaconleft = yackget(KVBEACON); // Beacon counts down in the background
+	yacktask(beacontask, interval ? YACKSECS(1) : 0); // Paused while the beacon is off
+	
+#if GREETWPM
 	yackinhibit(ON);  //side tone greeting to confirm the unit is alive and kicking
-	yackstring(imok);
+	yackgreet(imok);  // Paddle contact ends it and is keyed
 	yackinhibit(OFF);
+#endif
 	
 	while(1) // Endless core loop of the keyer app
 	{
@@ -592,7 +1084,7 @@ int main(void)
 		if (yackctrlkey(TRUE)) // If command key pressed, go to command mode
 			commandmode();
 		
-       	yackbeat();
+       	yackwait(); // Sleeps through idle beats with TICKLESS
 		beacon(PLAY); // Play beacon if requested
        	yackiambic(OFF);
         
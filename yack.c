@@ -41,10 +41,38 @@
 #include <stdint.h>
 #include "yack.h"
 
+// Text source for the playback engine
+
+struct textsrc
+{
+	byte		type;		// SRCFLASH, SRCEEPROM, SRCRAM, SRCNUMBER or SRCRING
+	const char	*p;			// Next character (Flash, EEPROM, RAM or history)
+	byte		left;		// Characters left (EEPROM, history) or trailing space pending (number)
+	uint32_t	n;			// Digits not yet sent (number)
+	uint32_t	place;		// Decimal place of the next digit, 0 when done (number)
+};
+
 // Forward declaration of private functions
 static      void key( byte mode); 
 static      char morsechar(byte buffer);
 static      void keylatch(void);
+static      void keypolicy(byte *lastsymbol);
+static      void kvscan(void);
+static      void kvappend(byte key, word value);
+static      void taskrun(void);
+static      void textout(char c, byte origin);
+static      void farnscalc(void);
+static      void farnsgap(byte n);
+static      char *msgbuffer(byte msgnr);
+static      char srcnext(struct textsrc *src);
+static      void textplay(struct textsrc *src, byte origin);
+static      void msgrecord(byte function, byte msgnr) __attribute__((noinline));
+#ifdef SO2R
+static      void keyidle(void);
+#endif
+#ifdef ADAPTIVE
+static      void gaplearn(word beats, byte *est, byte min, byte max);
+#endif
 
 // Enumerations
 
@@ -61,7 +89,114 @@ static		byte	volflags=0;		// Temporary working flags (volatile)
 static 		word	ctcvalue;		// Pitch
 static		word	wpmcnt;			// Speed
 static      byte    wpm;            // Real wpm
-static      byte    farnsworth;     // Additional Farnsworth pause
+static      byte    farnsworth;     // Farnsworth overall speed (0 = off)
+static      word    farnextra;      // Farnsworth stretch per gap dot (1/256 beats)
+static      byte    farnfrac;       // Farnsworth stretch carried over (1/256 beats)
+static volatile byte beatflag;      // Set by the heartbeat interrupt
+
+static      byte    keydown;        // TX is keyed right now
+
+// Element tokens handed from the keyer scheduler to its output driver
+#define     TOKENS          4       // Size of the token ring (must be a power of 2)
+
+struct token
+{
+	byte	mark;		// TRUE: key down, FALSE: gap
+	byte	beats;		// Length
+};
+
+_Static_assert(DAHLEN * WPMCALC(MINWPM) < 256, "Element length must fit a token");
+
+static      struct token tokens[TOKENS]; // Token ring
+static      byte    tokhead;        // Next free token
+static      byte    toktail;        // Next token to execute
+static      enum FSMSTATE drvstate; // Token being executed (IDLE = none)
+static      byte    drvleft;        // Beats left of the running token
+
+#define     KEYUPEVENT      1       // Driver: a key down token ended
+#define     DONEEVENT       2       // Driver: the last queued token ended
+
+#ifdef TELEMETRY
+static      uint32_t telemetry[TELCOUNT]; // Usage counters
+#endif
+
+#ifdef HISTORY
+static      char    history[HISTSIZE]; // Recently sent characters (ring buffer)
+static      byte    histhead;       // Next position to write
+static      byte    histcount;      // Number of valid characters
+static      byte    lastmsg;        // Last message played (0 = none)
+#endif
+
+#ifdef SO2R
+static      byte    radio = 1;      // Radio in focus (requested)
+static      byte    txpin = OUTPIN; // Key line of the radio being keyed
+#define     TXPIN   txpin
+#else
+#define     TXPIN   OUTPIN
+#endif
+
+#ifdef PTTOUT
+static      byte    pttset[3];      // PTT lead, tail (beats) and hang (dots)
+static      word    ptttimer;       // Beats until PTT is released (0 = not counting)
+#endif
+
+#ifdef ANALYZER
+static      word    analysis[ANACOUNT]; // Paddle timing statistics of this session
+#endif
+
+#ifdef ADAPTIVE
+static      byte    iegest;         // Learned inter-element gap (1/8 dots)
+static      byte    icgest;         // Learned inter-character gap (1/8 dots)
+#endif
+
+#ifdef SERIALOUT
+static volatile byte serqueue[SERQUEUE]; // Serial transmit queue
+static volatile byte serhead;       // Next free queue position
+static volatile byte sertail;       // Next character to transmit
+static volatile word serframe;      // Bits of the current character left to send, LSB first
+static      byte    serorigin;      // Origin of the last queued character
+#endif
+
+struct task
+{
+	void	(*run)(void);	// The task (NULL = free slot)
+	word	period;			// Beats between calls (0 = paused)
+	word	left;			// Beats until the next call (0 = paused)
+	byte	worst;			// Longest run so far (timer counts)
+};
+
+static      struct task tasks[TASKS]; // Background tasks run by yackbeat
+
+#ifdef POWERSAVE
+static      uint32_t pwrtimer;      // Beats the keyer could have slept
+#endif
+
+#ifdef BEATWATCH
+static      byte    stageworst[STAGES]; // Worst run time of each keyer stage (timer counts)
+static      byte    beatworst;      // Worst foreground time in a beat (timer counts)
+static      word    beatlate;       // Beats overrun
+static      word    beatwhere;      // Caller of yackbeat in the worst beat (word address)
+static      byte    beatfresh;      // Skip the next measurement (after power down or command key)
+#endif
+
+#if GREETWPM
+static      byte    padbreak;       // Paddle contact ends yackchar (greeting)
+#endif
+
+#ifdef TICKLESS
+static volatile byte quiet;         // Set by yackiambic when nothing is pending
+#endif
+
+static      byte    kvindex[KVKEYS]; // Position of the latest value per key (0 = none)
+static      byte    kvend;          // First free position in the settings store
+
+#ifdef HWKEY
+#define     BEATCNT         TCNT0   // Counts through each heartbeat
+#define     BEATPOS         TCNT0   // Timer counts since the beat started
+#else
+#define     BEATCNT         TCNT1
+#define     BEATPOS         ((TCNT1 + BEATCOUNTS - 1) % BEATCOUNTS) // Beat starts at OCR1A
+#endif
 
 // EEPROM Data
 
@@ -69,9 +204,9 @@ byte		magic EEMEM = MAGPAT;	// Needs to contain 'A5' if mem is valid
 byte		flagstor EEMEM = ( IAMBICB | TXKEY | SIDETONE);	//	Defaults	
 word		ctcstor EEMEM = DEFCTC;	// Pitch = 800Hz
 byte		wpmstor EEMEM = DEFWPM;	// 15 WPM
-byte        fwstor  EEMEM = 0; // No farnsworth pause
-word		user1 EEMEM = 0; // User storage
-word		user2 EEMEM = 0; // User storage
+byte        fwstor  EEMEM = 0; // No farnsworth timing
+word		user1 EEMEM = 0; // Beacon interval of older firmware, taken over once
+word		user2 EEMEM = 0; // Unused, keeps the messages where older firmware had them
 
 //char		eebuffer1[100] EEMEM = "message 1";
 //char		eebuffer2[100] EEMEM = "message 2";
@@ -80,6 +215,38 @@ char		eebuffer2[100] EEMEM = "message 2";
 char		eebuffer3[100] EEMEM = "message 3";
 char		eebuffer4[100] EEMEM = "message 4"; 
 
+// Operator profiles. Each one is a complete snapshot of the user settings.
+struct profile
+{
+	byte	flags;		// yackflags
+	word	ctc;		// Pitch
+	byte	wpm;		// Speed
+	byte	farns;		// Farnsworth overall speed
+};
+
+struct profile	profstor[PROFILES] EEMEM = 
+{
+	[0 ... PROFILES-1] = { FLAGDEFAULT, DEFCTC, 0, 0 } // Speed 0 marks an empty profile
+};
+
+byte		kvlog[KVSIZE] EEMEM = { [0 ... KVSIZE-1] = KVEND }; // Settings store, empty
+
+// Optional data goes last so that the messages and profiles stay where they are
+// whichever options are built in.
+
+#ifdef TELEMETRY
+uint32_t	telstor[TELCOUNT] EEMEM; // Usage counters, start at 0
+#endif
+
+#ifdef PTTOUT
+byte		pttstor[3] EEMEM = { DEFLEAD, DEFTAIL, DEFHANG }; // PTT timing
+#endif
+
+#ifdef ADAPTIVE
+byte		iegstor EEMEM = 8 * IEGLEN; // Learned inter-element gap
+byte		icgstor EEMEM = 8 * ICGLEN; // Learned inter-character gap
+#endif
+
 // Flash data
 
 //! Morse code table in Flash
@@ -93,80 +260,130 @@ char		eebuffer4[100] EEMEM = "message 4";
 //! Encoding: 01100000
 //!           .-
 //!             | This is the stop marker (1 with all trailing zeros)
+//!
+//! This list is the only place where characters are defined. The code table, the
+//! character table and compile time checks are all generated from it. Digits and 
+//! letters come first and in order, as they are looked up by position. Special 
+//! characters follow. Some stand in for prosigns and characters that are awkward
+//! to key: # for SK, + for AR, | for the paragraph break, ~ for " and ^ for '.
+//!
+//! To add a new character, add a line at the end.
+
+#define MORSESYMBOLS \
+	SYM('0', 0b11111100) \
+	SYM('1', 0b01111100) \
+	SYM('2', 0b00111100) \
+	SYM('3', 0b00011100) \
+	SYM('4', 0b00001100) \
+	SYM('5', 0b00000100) \
+	SYM('6', 0b10000100) \
+	SYM('7', 0b11000100) \
+	SYM('8', 0b11100100) \
+	SYM('9', 0b11110100) \
+	SYM('A', 0b01100000) \
+	SYM('B', 0b10001000) \
+	SYM('C', 0b10101000) \
+	SYM('D', 0b10010000) \
+	SYM('E', 0b01000000) \
+	SYM('F', 0b00101000) \
+	SYM('G', 0b11010000) \
+	SYM('H', 0b00001000) \
+	SYM('I', 0b00100000) \
+	SYM('J', 0b01111000) \
+	SYM('K', 0b10110000) \
+	SYM('L', 0b01001000) \
+	SYM('M', 0b11100000) \
+	SYM('N', 0b10100000) \
+	SYM('O', 0b11110000) \
+	SYM('P', 0b01101000) \
+	SYM('Q', 0b11011000) \
+	SYM('R', 0b01010000) \
+	SYM('S', 0b00010000) \
+	SYM('T', 0b11000000) \
+	SYM('U', 0b00110000) \
+	SYM('V', 0b00011000) \
+	SYM('W', 0b01110000) \
+	SYM('X', 0b10011000) \
+	SYM('Y', 0b10111000) \
+	SYM('Z', 0b11001000) \
+	SYM('?', 0b00110010) \
+	SYM('.', 0b01010110) \
+	SYM('/', 0b10010100) \
+	SYM('!', 0b11101000) /* ! (American Morse version, commonly used in ham circles) */ \
+	SYM(',', 0b11001110) \
+	SYM(':', 0b11100010) \
+	SYM(';', 0b10101010) \
+	SYM('~', 0b01001010) /* " */ \
+	SYM('$', 0b00010011) \
+	SYM('^', 0b01111010) /* ' (Apostrophe) */ \
+	SYM('(', 0b10110100) /* ( or [ (also prosign KN) */ \
+	SYM(')', 0b10110110) /* ) or ] */ \
+	SYM('-', 0b10000110) /* - (Hyphen or single dash) */ \
+	SYM('@', 0b01101010) \
+	SYM('_', 0b00110110) /* _ (Underline) */ \
+	SYM('|', 0b01010010) /* Paragaraph break symbol */ \
+	SYM('=', 0b10001100) /* = and BT */ \
+	SYM('#', 0b00010110) /* SK */ \
+	SYM('+', 0b01010100) /* + and AR */ \
+	SYM('*', 0b10001011) /* BK */ \
+	SYM('%', 0b01000100) /* AS */ \
+	SYM('&', 0b10101100) /* KA (also ! in alternate Continental Morse) */ \
+	SYM('<', 0b00010100) /* VE */ \
+	SYM('>', 0b01011000) /* AA */
+
+#define MORSEALNUM		36	// Digits and letters at the start of the list
 
 const byte morse[] PROGMEM = 
 {
-	
-	0b11111100, // 0
-	0b01111100, // 1
-	0b00111100, // 2
-	0b00011100, // 3
-	0b00001100, // 4
-	0b00000100, // 5
-	0b10000100, // 6
-	0b11000100, // 7
-	0b11100100, // 8
-	0b11110100, // 9
-	0b01100000, // A
-	0b10001000, // B
-	0b10101000, // C
-	0b10010000, // D
-	0b01000000, // E
-	0b00101000, // F
-	0b11010000, // G
-	0b00001000, // H
-	0b00100000, // I                                
-	0b01111000, // J
-	0b10110000, // K
-	0b01001000, // L
-	0b11100000, // M
-	0b10100000, // N
-	0b11110000, // O
-	0b01101000, // P
-	0b11011000, // Q
-	0b01010000, // R
-	0b00010000, // S
-	0b11000000, // T
-	0b00110000, // U
-	0b00011000, // V
-	0b01110000, // W
-	0b10011000, // X
-	0b10111000, // Y
-	0b11001000, // Z
-	0b00110010, // ?
-	0b01010110, // .
-	0b10010100, // /
-	0b11101000, // ! (American Morse version, commonly used in ham circles)
-	0b11001110, // ,
-	0b11100010, // :
-	0b10101010, // ;
-	0b01001010, // "
-	0b00010011, // $
-	0b01111010, // ' (Apostrophe)
-	0b10110100, // ( or [ (also prosign KN)
-    0b10110110, // ) or ]
-	0b10000110, // - (Hyphen or single dash)
-	0b01101010, // @
-	0b00110110, // _ (Underline)
-	0b01010010, // Paragaraph break symbol
-	0b10001100, // = and BT
-	0b00010110, // SK
-	0b01010100, // + and AR
-	0b10001011, // BK
-	0b01000100, // AS
-	0b10101100, // KA (also ! in alternate Continental Morse)
-	0b00010100, // VE
-	0b01011000  // AA
+#define SYM(c, code)	code,
+	MORSESYMBOLS
+#undef SYM
+};
+
+const char morsesym[] PROGMEM =
+{
+#define SYM(c, code)	c,
+	MORSESYMBOLS
+#undef SYM
 };
 
+// Compile time checks of the list: digits and letters at their position, special 
+// characters after them and every code with a stop marker and at least one element.
+#define MORSEPOS(c)		((c) >= '0' && (c) <= '9' ? (c) - '0' : (c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 10 : -1)
+#define MORSECHECK(c, code, i) \
+	_Static_assert((MORSEPOS(c) < 0 ? (i) >= MORSEALNUM : MORSEPOS(c) == (i)) && \
+	               (code) != 0 && (code) != 0x80, "Bad entry in MORSESYMBOLS");
 
-// The special characters at the end of the above table can not be decoded
-// without a small table to define their content. # stands for SK, $ for AR
+enum { MORSEBASE = __COUNTER__ + 1 };
 
-// To add new characters, add them in the code table above at the end and below
-// Do not forget to increase the legth of the array..
+#define SYM(c, code)	MORSECHECK(c, code, __COUNTER__ - MORSEBASE)
+MORSESYMBOLS
+#undef SYM
 
-const char spechar[24] PROGMEM = "?./!,:;~$^()-@_|=#+*%&<>";
+static void __attribute__((unused)) morsecheck(byte code, char c)
+/*! 
+ @brief     Compile time check of the morse list, never called
+ 
+ A character or a code used twice makes the compiler stop with a duplicate case value.
+ 
+ */
+{
+	switch (code)
+	{
+#define SYM(c, code)	case (code):
+		MORSESYMBOLS
+#undef SYM
+			break;
+	}
+	
+	switch (c)
+	{
+#define SYM(c, code)	case (c):
+		MORSESYMBOLS
+#undef SYM
+			break;
+	}
+}
 
 
 
@@ -190,7 +407,21 @@ void yackreset (void)
     wpm=DEFWPM; // Init to default speed
 	wpmcnt=(1200/YACKBEAT)/DEFWPM; // default speed
     farnsworth=0; // No Farnsworth gap
+    farnscalc();
 	yackflags = FLAGDEFAULT;  
+#ifdef SO2R
+	keyidle();
+#endif
+
+#ifdef ADAPTIVE
+	yackgaps(); // Forget learned gaps
+#endif
+
+#ifdef PTTOUT
+	pttset[PTTLEAD] = DEFLEAD; // Default PTT timing
+	pttset[PTTTAIL] = DEFTAIL;
+	pttset[PTTHANG] = DEFHANG;
+#endif
 
 	volflags |= DIRTYFLAG;
 	yacksave(); // Store them in EEPROM
@@ -210,10 +441,17 @@ void yackinit (void)
 {
 	
 	byte magval;
+	word legacy; // Beacon interval of older firmware
 	
 	// Configure DDR. Make OUT and ST output ports
 	SETBIT (OUTDDR,OUTPIN);    
 	SETBIT (STDDR,STPIN);
+#ifdef SO2R
+	SETBIT (OUTDDR,KEY2PIN);
+#endif
+#ifdef PTTOUT
+	SETBIT (PTTDDR,PTTPIN);
+#endif
 	
 	// Raise internal pullups for all inputs
 	SETBIT (KEYPORT,DITPIN);  
@@ -227,15 +465,46 @@ void yackinit (void)
 		ctcvalue = eeprom_read_word(&ctcstor); // Retrieve last ctc setting
 		wpm = eeprom_read_byte(&wpmstor); // Retrieve last wpm setting
         wpmcnt=(1200/YACKBEAT)/wpm; // Calculate speed
-		farnsworth = eeprom_read_byte(&fwstor); // Retrieve last wpm setting	
+		farnsworth = eeprom_read_byte(&fwstor); // Retrieve last Farnsworth setting	
+		farnscalc();
+
+#ifdef PTTOUT
+		eeprom_read_block(pttset, pttstor, sizeof(pttset)); // Retrieve PTT timing
+#endif
 		yackflags = eeprom_read_byte(&flagstor); // Retrieve last flags	
+
+#ifdef ADAPTIVE
+		iegest = eeprom_read_byte(&iegstor); // Retrieve learned gaps
+		icgest = eeprom_read_byte(&icgstor);
+		if (iegest < MINIEG || iegest > MAXIEG || icgest < MINICG || icgest > MAXICG)
+			yackgaps(); // Never learned (e.g. after an update)
+#endif
 	}
 	else
 	{
 		yackreset();
 	}	
 	
+#ifdef SO2R
+	keyidle(); // Both radios unkeyed from power up on
+#endif
+	
 	yackinhibit(OFF);
+	
+	kvscan(); // Index the settings store
+
+#ifdef TELEMETRY
+	
+	eeprom_read_block(telemetry, telstor, sizeof(telemetry)); // Counters survive resets
+	
+#endif
+	
+	if (magval == MAGPAT && !kvindex[KVBEACON & ~KVWORD]) // Updated from older firmware?
+	{
+		legacy = eeprom_read_word(&user1);
+		if (legacy && legacy <= 9999)
+			yackset(KVBEACON, legacy); // Take over its beacon interval
+	}
 
 #ifdef POWERSAVE
     
@@ -244,6 +513,19 @@ void yackinit (void)
     
 #endif
     
+#ifdef HWKEY
+    
+    // Initialize timer0 to serve as the system heartbeat, same timing as below. The 
+    // compare match that ends each beat also drives the TX line on OC0A, which starts idle.
+    
+    OCR0A = 78; // Clear timer after 79 counts
+    TCCR0A = (1<<WGM01) | (1<<COM0A1) | ((yackflags & TXINV) ? (1<<COM0A0) : 0); // CTC mode
+    TCCR0B = (1<<CS01) | (1<<CS00); // Prescale ck by 64
+    TCCR0B |= (1<<FOC0A); // Bring the TX line to idle now
+    TIMSK |= (1<<OCIE0A); // Compare match A raises the heartbeat interrupt
+    
+#else
+    
     // Initialize timer1 to serve as the system heartbeat
     // CK runs at 1MHz. Prescaling by 64 makes that 15625 Hz.
     // Counting 78 cycles of that generates an overflow every 5ms
@@ -251,6 +533,58 @@ void yackinit (void)
     OCR1C = 78; // 77 counts per cycle
     TCCR1 |= (1<<CTC1) | 0b00000111 ; // Clear Timer on match, prescale ck by 64
     OCR1A = 1; // CTC mode does not create an overflow so we use OCR1A
+    TIMSK |= (1<<OCIE1A); // Compare match A raises the heartbeat interrupt
+    
+#endif
+
+#ifdef SERIALOUT
+    
+    SETBIT(SERPORT,SERPIN); // Serial line idles high
+    
+#endif
+    
+    sei();
+    
+}
+
+
+
+#ifdef HWKEY
+ISR(TIMER0_COMPA_vect)
+#else
+ISR(TIMER1_COMPA_vect)
+#endif
+/*! 
+ @brief     Heartbeat interrupt
+ 
+ Fires every YACKBEAT ms and flags the beat for yackbeat. With HWKEY configured, Timer0
+ runs the heartbeat and the TX line has already changed in hardware when this is called. With SERIALOUT configured, it
+ also shifts out one bit of the serial text output. This costs a bounded few dozen cycles
+ per beat and never touches the keying outputs, so keying timing is not affected.
+ */
+{
+    
+#ifdef SERIALOUT
+    
+    if (!serframe && serhead != sertail && !(volflags & SIDETONE)) // Start a new frame?
+    {
+        serframe = (serqueue[sertail] << 1) | 0x200; // Start bit, 8 data bits, stop bit
+        sertail = (sertail + 1) & (SERQUEUE - 1);
+    }
+    
+    if (serframe)
+    {
+        if (serframe & 1)
+            SETBIT(SERPORT,SERPIN);
+        else
+            CLEARBIT(SERPORT,SERPIN);
+        
+        serframe >>= 1;
+    }
+    
+#endif
+    
+    beatflag = TRUE;
     
 }
 
@@ -262,10 +596,14 @@ ISR(PCINT0_vect)
  
  This function is called whenever the system is in sleep mode and there is a level change on one of the contacts 
  we are monitoring (dit, dah and the command key). As all handling is already taken care of by polling in the main 
- routines, there is nothing we need to do here.
+ routines, there is nothing we need to do here. With TICKLESS the change also keeps yackwait from
+ going to sleep before the main loop has seen it.
  */
 {
     // Nothing to do here. All we want is to wake up..
+#ifdef TICKLESS
+    quiet = FALSE; // A contact changed since yackiambic last looked, don't doze off
+#endif
 }
 
 
@@ -276,7 +614,7 @@ void yackpower(byte n)
  This is called in yackbeat intervals with either a TRUE or FALSE as parameter. Whenever the
  parameter is TRUE a beat counter is advanced until the timeout level is reached. When timeout
  is reached, the chip shuts down and will only wake up again when issued a level change interrupt on
- either of the input pins.
+ either of the input pins. A PTT still held by its hang time is released before that.
  
  When the parameter is FALSE, the counter is reset.
  
@@ -285,30 +623,49 @@ void yackpower(byte n)
 */
 
 {
-    static uint32_t shdntimer=0;
-    
     if (n) // True = we could go to sleep
     {
-        if(shdntimer++ == YACKSECS(PSTIME))
+        if(pwrtimer++ >= YACKSECS(PSTIME))
         {
-            shdntimer=0; // So we do not go to sleep right after waking up..
+            pwrtimer=0; // So we do not go to sleep right after waking up..
+
+#ifdef TELEMETRY
+            
+            yackcount(TELPWRDOWN);
+            if (telemetry[TELPWRDOWN] % TELFLUSH == 0) // Write counters now and then
+                yackcountsave();
+            
+#endif
+
+#ifdef PTTOUT
+            
+            // The PTT hang can outlast the timeout, release the PTT rather than
+            // leave the radio on transmit while we sleep
+            ptttimer = 0;
+            CLEARBIT(PTTPORT,PTTPIN);
+            
+#endif
 
             set_sleep_mode(SLEEP_MODE_PWR_DOWN);
             sleep_bod_disable();
             sleep_enable();
             sei();
             sleep_cpu();
-            cli();
+            sleep_disable();
             
-            // There is no technical reason to CLI here but it avoids hitting the ISR every time
-            // the paddles are touched. If the remaining code needs the interrupts this is OK to remove.
+#ifdef BEATWATCH
+            beatfresh = TRUE;
+#endif
+            
+            // Interrupts stay enabled as the heartbeat is interrupt driven. The pin change ISR is 
+            // empty so touching the paddles costs next to nothing.
             
         }
         
     }
     else // Passed parameter is FALSE
     {
-        shdntimer=0;
+        pwrtimer=0;
     }
 
 }
@@ -332,14 +689,32 @@ void yacksave (void)
 	if(volflags & DIRTYFLAG) // Dirty flag set?
 	{	
 		
+		yackcount(TELEEWRITES);
+		
 		eeprom_write_byte(&magic, MAGPAT);
 		eeprom_write_word(&ctcstor, ctcvalue);
 		eeprom_write_byte(&wpmstor, wpm);
 		eeprom_write_byte(&flagstor, yackflags);
         eeprom_write_byte(&fwstor, farnsworth);
+
+#ifdef PTTOUT
+		
+		eeprom_write_byte(&pttstor[PTTLEAD], pttset[PTTLEAD]);
+		eeprom_write_byte(&pttstor[PTTTAIL], pttset[PTTTAIL]);
+		eeprom_write_byte(&pttstor[PTTHANG], pttset[PTTHANG]);
+		
+#endif
 		
 		volflags &= ~DIRTYFLAG; // Clear the dirty flag
 	}
+
+#ifdef ADAPTIVE
+	
+	// Learned gaps change without setting the dirty flag. Only bytes that differ are written.
+	eeprom_update_byte(&iegstor, iegest);
+	eeprom_update_byte(&icgstor, icgest);
+	
+#endif
 	
 }
 
@@ -352,6 +727,9 @@ void yackinhibit (byte mode)
  This function is used to inhibit and re-enable TX keying (if configured) and enforce the internal 
  sidetone oscillator to be active so that the user can communicate with the keyer.
  
+ With SERIALOUT configured, a serial character still being sent when keying is inhibited
+ is completed first, as the sidetone shares its pin.
+ 
  @param mode   ON inhibits keying, OFF re-enables keying 
  
  */
@@ -361,6 +739,13 @@ void yackinhibit (byte mode)
 	{
 		volflags &= ~(TXKEY | SIDETONE);
 		volflags |= SIDETONE;
+		
+#ifdef SERIALOUT
+		// No new frame starts now, but one on the line is finished before the
+		// sidetone takes over the pin (10 beats at most)
+		while (serframe)
+			yackbeat();
+#endif
 	}
 	
 	else
@@ -375,160 +760,918 @@ void yackinhibit (byte mode)
 
 
 
-word yackuser (byte func, byte nr, word content)
+static void kvscan(void)
 /*! 
- @brief     Saves user defined settings
+ @brief     Builds the index of the settings store
  
- The routine using this library is given the opportunity to save up to two 16 bit sized
- values in EEPROM. In case of the sample main function this is used to store the beacon interval 
- timer value. The routine is not otherwise used by the library.
+ Walks the record log in EEPROM once and remembers where the latest value of each key
+ is, so that reads need no search later. The log ends at the first free or invalid key.
  
- @param func    States if the data is retrieved (READ) or written (WRITE) to EEPROM
- @param nr      1 or 2 (Number of user storage to access)
- @param content The 16 bit word to write. Not used in read mode.
- @return        The content of the retrieved value in read mode.
+ This is a private function.
  
  */
 {
+	byte	pos = 0;
+	byte	key;
+	byte	size;
 	
-    
-	if (func == READ)
+	while (pos < KVSIZE)
 	{
-		if (nr == 1) 
-			return (eeprom_read_word(&user1));
-		else if (nr == 2)
-			return (eeprom_read_word(&user2));
+		key = eeprom_read_byte(&kvlog[pos]);
+		size = (key & KVWORD) ? 3 : 2;
+		
+		if ((key & ~KVWORD) == 0 || (key & ~KVWORD) >= KVKEYS || pos + size > KVSIZE)
+			break; // End of log or garbage
+		
+		kvindex[key & ~KVWORD] = pos + 1; // Value follows the key
+		pos += size;
 	}
 	
-	if (func == WRITE)
-	{
-        
-		if (nr == 1)
-			eeprom_write_word(&user1, content);
-		else if (nr == 2)
-			eeprom_write_word(&user2, content);
-	}
-
-    return (FALSE);
-    
+	kvend = pos;
 }
 
 
 
-word yackwpm(void)
-/*! 
- @brief     Retrieves the current WPM speed
- 
- This function delivers the current WPM speed. 
-
- @return        Current speed in WPM
- 
- */
-{
-    
-    return wpm; 
-    
-}
-
-
-void yackspeed (byte dir, byte mode)
+word yackget(byte key)
 /*! 
- @brief     Increases or decreases the current WPM speed
+ @brief     Reads a setting from the settings store
  
- The amount of increase or decrease is in amounts of wpmcnt. Those are close to real
- WPM in a 10ms heartbeat but can significantly differ at higher heartbeat speeds.
+ Costs one index lookup in RAM and one or two EEPROM byte reads.
  
- @param dir     UP (faster) or DOWN (slower)
+ @param key     The key of the setting (e.g. KVBEACON)
+ @return        The value, 0 if it was never written
  
  */
 {
-    
-    if (mode == FARNSWORTH)
-    {
-        if ((dir == UP) && (farnsworth > 0))
-            farnsworth--;
-        
-        if ((dir == DOWN) && (farnsworth < MAXFARN))
-            farnsworth++;
-    }
-    else // WPMSPEED
-    {
-        if ((dir == UP) && (wpm < MAXWPM))
-            wpm++;
-        
-        if ((dir == DOWN) && (wpm > MINWPM))
-            wpm--;
-        
-        wpmcnt=(1200/YACKBEAT)/wpm; // Calculate beats
-
-	}
+	byte	pos = kvindex[key & ~KVWORD];
 	
-	volflags |= DIRTYFLAG; // Set the dirty flag	
-    
-    yackplay(DIT);
-    yackdelay(IEGLEN);	// Inter Element gap  
-    yackplay(DAH);
-    yackdelay(ICGLEN);	// Inter Character gap  
-    yackfarns(); // Additional Farnsworth delay
-    
+	if (!pos)
+		return (0);
+	
+	if (key & KVWORD)
+		return (eeprom_read_word((word *)&kvlog[pos]));
+	
+	return (eeprom_read_byte(&kvlog[pos]));
 }
 
 
 
-void yackbeat (void)
+static void kvappend(byte key, word value)
 /*! 
- @brief     Heartbeat delay
+ @brief     Appends a record to the settings store
  
- Several functions in the keyer are timing dependent. The most prominent example is the
- yackiambic function that implements the IAMBIC keyer finite state machine.
- The same expects to be called in intervals of YACKBEAT milliseconds. How this is 
- implemented is left to the user. In a more complex application this would be done
- using an interrupt or a timer. For simpler cases this is a busy wait routine
- that delays exactly YACKBEAT ms.
+ The value and a new end mark are written before the key, so a record only becomes 
+ valid when it is complete. The caller makes sure the record fits.
+ 
+ This is a private function.
+ 
+ @param key     The key of the setting
+ @param value   The value to store
  
  */
 {
-    while((TIFR & (1<<OCF1A)) == 0); // Wait for Timeout
-    TIFR |= (1<<OCF1A);                // Reset output compare flag
+	byte	size = (key & KVWORD) ? 3 : 2;
+	
+	if (key & KVWORD)
+		eeprom_update_word((word *)&kvlog[kvend + 1], value);
+	else
+		eeprom_update_byte(&kvlog[kvend + 1], value);
+	
+	if (kvend + size < KVSIZE)
+		eeprom_update_byte(&kvlog[kvend + size], KVEND); // Log ends behind the record
+	
+	eeprom_update_byte(&kvlog[kvend], key); // Commit the record
+	
+	kvindex[key & ~KVWORD] = kvend + 1;
+	kvend += size;
 }
 
 
 
-void yackpitch (byte dir)
+void yackset(byte key, word value)
 /*! 
- @brief     Increases or decreases the sidetone pitch
+ @brief     Writes a setting to the settings store
  
- Changes are done not in Hz but in ctc control values. This is to avoid extensive 
- calculations at runtime. As is all calculations are done by the preprocessor.
+ Settings are not overwritten in place. A new record is appended to the log in EEPROM,
+ which spreads the wear over the whole store. When the log is full, it is compacted to
+ the latest value of each key first. The log is emptied before it is rewritten, so a power
+ loss during compaction can not mix up values, but the settings not yet rewritten are lost
+ and read as 0 (never written). Writing an unchanged value costs nothing.
  
- @param dir     UP or DOWN
+ @param key     The key of the setting (e.g. KVBEACON)
+ @param value   The value to store (only the low byte unless the key has KVWORD set)
  
  */
 {
-	if (dir == UP)
-		ctcvalue--;
-	if (dir == DOWN)
-		ctcvalue++;
+	byte	keys[KVKEYS];
+	word	values[KVKEYS];
+	byte	i;
 	
-	if (ctcvalue < MAXCTC)
-		ctcvalue = MAXCTC;
+	if (kvindex[key & ~KVWORD] && yackget(key) == value)
+		return; // Nothing changed
 	
-	if (ctcvalue > MINCTC)
-		ctcvalue = MINCTC;
+	yackcount(TELEEWRITES);
 	
-	volflags |= DIRTYFLAG; // Set the dirty flag	
+	if (kvend + ((key & KVWORD) ? 3 : 2) > KVSIZE) // Log full, keep only the latest values
+	{
+		for (i = 1; i < KVKEYS; i++)
+		{
+			keys[i] = kvindex[i] ? eeprom_read_byte(&kvlog[kvindex[i] - 1]) : 0;
+			values[i] = keys[i] ? yackget(keys[i]) : 0;
+			kvindex[i] = 0;
+		}
+		
+		kvend = 0;
+		eeprom_update_byte(&kvlog[0], KVEND); // Old records are invalid from here on
+		
+		for (i = 1; i < KVKEYS; i++)
+			if (keys[i] && i != (key & ~KVWORD))
+				kvappend(keys[i], values[i]);
+	}
 	
+	kvappend(key, value);
 }
 
 
 
-
-void yacktune (void)
+byte yackprofile (byte func, byte nr)
 /*! 
- @brief     Activates Tuning mode
+ @brief     Loads or stores an operator profile
  
- This produces a solid keydown for TUNEDURATION seconds. After this the TX is unkeyed.
- The same can be achieved by presing either the DIT or the DAH contact or the control key.
+ A profile holds all user settings (flags, pitch, speed and Farnsworth speed). In READ mode
+ the profile is loaded into the working settings in one go and the dirty flag is set so that
+ the next call to yacksave makes it the power-on configuration. The configuration lock is not
+ part of a profile and is left as it is. In WRITE mode the current settings are stored in the 
+ profile. Only bytes that actually change are written to EEPROM.
+ 
+ @param func    READ (load profile) or WRITE (store current settings in profile)
+ @param nr      1 to PROFILES (Number of the profile to access)
+ @return        TRUE if all was OK, FALSE if the profile number or its content was invalid
+ 
+ */
+{
+	struct profile	p;
+	
+	if (nr < 1 || nr > PROFILES)
+		return (FALSE);
+	
+	if (func == READ)
+	{
+		eeprom_read_block(&p, &profstor[nr-1], sizeof(p));
+		
+		if (p.wpm < MINWPM || p.wpm > MAXWPM || p.ctc < MAXCTC || p.ctc > MINCTC)
+			return (FALSE); // Never saved or corrupted
+		
+		yackflags = (p.flags & ~CONFLOCK) | (yackflags & CONFLOCK);
+#ifdef SO2R
+		keyidle(); // TXINV may have changed
+#endif
+		ctcvalue = p.ctc;
+		wpm = p.wpm;
+		wpmcnt=(1200/YACKBEAT)/wpm; // Calculate speed
+		farnsworth = p.farns;
+		farnscalc();
+		
+		volflags |= DIRTYFLAG; // Set the dirty flag	
+	}
+	
+	if (func == WRITE)
+	{
+		p.flags = yackflags & ~CONFLOCK;
+		p.ctc = ctcvalue;
+		p.wpm = wpm;
+		p.farns = farnsworth;
+		
+		eeprom_update_block(&p, &profstor[nr-1], sizeof(p));
+		yackcount(TELEEWRITES);
+	}
+	
+	return (TRUE);
+	
+}
+
+
+
+#ifdef ADAPTIVE
+
+void yackgaps(void)
+/*! 
+ @brief     Resets the adaptive decode thresholds
+ 
+ The learned inter-element and inter-character gaps are set back to their nominal
+ values of IEGLEN and ICGLEN dots. They are stored with the next call to yacksave.
+ 
+ */
+{
+	iegest = 8 * IEGLEN;
+	icgest = 8 * ICGLEN;
+}
+
+
+
+static void gaplearn(word beats, byte *est, byte min, byte max)
+/*! 
+ @brief     Updates a gap estimate with a new observation
+ 
+ The gap is converted into 1/8 dots and the estimate moves 1/(2^GAPSHIFT) of the way
+ towards it, staying within the given limits.
+ 
+ This is a private function.
+ 
+ @param beats   Length of the observed gap in heartbeats
+ @param est     The estimate to update
+ @param min     Lower limit of the estimate
+ @param max     Upper limit of the estimate
+ 
+ */
+{
+	int		gap;
+	
+	gap = (beats << 3) / wpmcnt; // Gap in 1/8 dots
+	if (gap > 255) gap = 255;
+	
+	gap = *est + (gap - *est) / (1 << GAPSHIFT);
+	
+	if (gap < min) gap = min;
+	if (gap > max) gap = max;
+	
+	*est = gap;
+}
+
+#endif
+
+
+
+#ifdef TELEMETRY
+
+void yackcount(byte nr)
+/*! 
+ @brief     Advances a usage counter
+ 
+ @param nr  The counter to advance (TELKEYDOWN to TELEEWRITES)
+ 
+ */
+{
+	telemetry[nr]++;
+}
+
+
+
+uint32_t yackcounter(byte nr)
+/*! 
+ @brief     Reads a usage counter
+ 
+ @param nr  The counter to read (TELKEYDOWN to TELEEWRITES)
+ @return    The counter value, 0 if nr is out of range
+ 
+ */
+{
+	if (nr >= TELCOUNT)
+		return (0);
+	
+	return telemetry[nr];
+}
+
+
+
+void yackcountsave(void)
+/*! 
+ @brief     Writes the usage counters to EEPROM
+ 
+ This happens rarely (every TELFLUSH-th power down, or when a counter is queried). Only
+ bytes that changed since the last call are written, which for most counters is just the
+ lowest one. Writing the counters is not counted in TELEEWRITES, which would otherwise
+ change a byte on every call.
+ 
+ */
+{
+	eeprom_update_block(telemetry, telstor, sizeof(telemetry));
+}
+
+#endif
+
+
+
+#ifdef ANALYZER
+
+static void analyze(byte nr)
+/*! 
+ @brief     Counts a paddle timing event
+ 
+ Counting stops for good once the element counter is full, so that all statistics
+ of a session stay consistent with each other.
+ 
+ This is a private function.
+ 
+ @param nr  The statistic to advance (ANAELEMENTS to ANALATE)
+ 
+ */
+{
+	if (analysis[ANAELEMENTS] < 0xFFFF)
+		analysis[nr]++;
+}
+
+
+
+word yackstats(byte nr)
+/*! 
+ @brief     Reads the paddle timing statistics of this session
+ 
+ Gaps between paddle elements are sorted into bins of whole dot lengths (1 to 7, the last
+ one holding all longer gaps). Squeezes are counted as early when the opposite paddle was
+ closed while the element sounded and as late when it was closed in the gap that followed.
+ A character counts as near the threshold if one of its gaps, or the gap before it, lay
+ within half a dot of the length that separates characters.
+ 
+ @param nr  ANAELEMENTS, ANAGAPS + 1 to ANAGAPS + 7, ANACHARS, ANANEAR (% of characters),
+            ANAEARLY or ANALATE (% of elements)
+ @return    The statistic, 0 if nr is out of range
+ 
+ */
+{
+	word	total = analysis[(nr == ANANEAR) ? ANACHARS : ANAELEMENTS];
+	
+	if (nr >= ANACOUNT)
+		return (0);
+	
+	if (nr < ANANEAR)
+		return analysis[nr];
+	
+	if (!total)
+		return (0);
+	
+	return ((uint32_t)analysis[nr] * 100 + total / 2) / total; // Rounded percentage
+}
+
+#endif
+
+
+
+#ifdef PTTOUT
+
+byte yackptt(byte param, word value)
+/*! 
+ @brief     Sets the PTT timing
+ 
+ @param param   PTTLEAD, PTTTAIL (both in ms) or PTTHANG (in dots)
+ @param value   The new setting
+ @return        TRUE if all was OK, FALSE if the value was out of range
+ 
+ */
+{
+	if (param != PTTHANG)
+		value = YACKMS(value); // ms to beats
+	
+	if (value > 255)
+		return (FALSE);
+	
+	pttset[param] = value;
+	
+	volflags |= DIRTYFLAG; // Set the dirty flag	
+	
+	return (TRUE);
+}
+
+#endif
+
+
+
+#ifdef SO2R
+
+static void keyidle(void)
+/*! 
+ @brief     Drives both key lines to their idle level
+ 
+ Called between elements, at power up and whenever TXINV may have changed, so the radio
+ out of focus never sees a key line left at the old polarity.
+ 
+ This is a private function.
+ 
+ */
+{
+	if (yackflags & TXINV)
+		OUTPORT |= (1<<OUTPIN) | (1<<KEY2PIN);
+	else
+		OUTPORT &= ~((1<<OUTPIN) | (1<<KEY2PIN));
+}
+
+
+
+byte yackradio(byte nr)
+/*! 
+ @brief     Moves the focus to another radio
+ 
+ Macros and the paddle key the radio in focus. If an element is being sent, the new 
+ focus takes effect once it has ended.
+ 
+ @param nr  1 or 2 (Radio to key)
+ @return    TRUE if all was OK, FALSE if there is no such radio
+ 
+ */
+{
+	if (nr != 1 && nr != 2)
+		return (FALSE);
+	
+	radio = nr;
+	
+	if (!keydown) // Between elements? Then switch right away
+		key(UP);
+	
+	return (TRUE);
+}
+
+#endif
+
+
+
+#ifdef HISTORY
+
+byte yackreplay(byte what, byte n)
+/*! 
+ @brief     Sends recently sent text again
+ 
+ Replays the last word or the last n characters sent on air (from the paddle or from 
+ messages), or plays the last message again. Replayed text is not added to the history,
+ so repeated requests send the same text. Playback stops when the command key is pressed.
+ 
+ @param what    LASTWORD, LASTCHARS or LASTMSG
+ @param n       Number of characters (LASTCHARS only)
+ @return        TRUE if all was OK, FALSE if there was nothing to replay
+ 
+ */
+{
+	struct textsrc	src;
+	byte			end = histcount; // Characters before the end of the replay
+	byte			i;
+	
+	if (what == LASTMSG)
+	{
+		if (!lastmsg)
+			return (FALSE);
+		
+		// Straight from EEPROM like yackmessage, but neither recorded nor counted
+		src.type = SRCEEPROM;
+		src.p = msgbuffer(lastmsg);
+		src.left = RBSIZE;
+		
+		textplay(&src, 0);
+		return (TRUE);
+	}
+	
+	if (what == LASTWORD)
+	{
+		// Skip trailing word gaps, then count back to the start of the word
+		while (end && history[(histhead + HISTSIZE - histcount + end - 1) % HISTSIZE] == ' ')
+			end--;
+		
+		for (n = 0; n < end && history[(histhead + HISTSIZE - histcount + end - n - 1) % HISTSIZE] != ' '; n++)
+			;
+	}
+	
+	if (n > end) n = end; // Can not replay more than we have
+	
+	if (!n)
+		return (FALSE);
+	
+	i = (histhead + HISTSIZE - histcount + end - n) % HISTSIZE; // First character
+	
+	src.type = SRCRING;
+	src.p = history + i;
+	src.left = n;
+	
+	textplay(&src, 0);
+	yackchar(' '); // End with a word gap
+	
+	return (TRUE);
+}
+
+#endif
+
+
+
+word yackwpm(void)
+/*! 
+ @brief     Retrieves the current WPM speed
+ 
+ This function delivers the current WPM speed. 
+
+ @return        Current speed in WPM
+ 
+ */
+{
+    
+    return wpm; 
+    
+}
+
+
+void yackspeed (byte dir, byte mode)
+/*! 
+ @brief     Increases or decreases the current WPM speed
+ 
+ The amount of increase or decrease is in amounts of wpmcnt. Those are close to real
+ WPM in a 10ms heartbeat but can significantly differ at higher heartbeat speeds.
+ 
+ In FARNSWORTH mode the overall speed is changed instead. It can be lowered down to MINWPM,
+ raising it up to the character speed switches Farnsworth timing off.
+ 
+ @param dir     UP (faster) or DOWN (slower)
+ @param mode    WPMSPEED or FARNSWORTH
+ 
+ */
+{
+    
+    if (mode == FARNSWORTH)
+    {
+        if (!farnsworth) // Farnsworth off? Start at character speed
+            farnsworth = wpm;
+        
+        if (dir == UP)
+            farnsworth++;
+        
+        if ((dir == DOWN) && (farnsworth > MINWPM))
+            farnsworth--;
+        
+        if (farnsworth >= wpm) // Reached character speed? Then switch off
+            farnsworth = 0;
+    }
+    else // WPMSPEED
+    {
+        if ((dir == UP) && (wpm < MAXWPM))
+            wpm++;
+        
+        if ((dir == DOWN) && (wpm > MINWPM))
+            wpm--;
+        
+        wpmcnt=(1200/YACKBEAT)/wpm; // Calculate beats
+
+	}
+	
+    farnscalc();
+	
+	volflags |= DIRTYFLAG; // Set the dirty flag	
+    
+    yackplay(DIT);
+    yackdelay(IEGLEN);	// Inter Element gap  
+    yackplay(DAH);
+    yackdelay(ICGLEN);	// Inter Character gap  
+    yackfarns(); // Additional Farnsworth delay
+    
+}
+
+
+
+void yackbeat (void)
+/*! 
+ @brief     Heartbeat delay
+ 
+ Several functions in the keyer are timing dependent. The most prominent example is the
+ yackiambic function that implements the IAMBIC keyer finite state machine.
+ The same expects to be called in intervals of YACKBEAT milliseconds. How this is 
+ implemented is left to the user. In a more complex application this would be done
+ using an interrupt or a timer. For simpler cases this is a busy wait routine
+ that delays exactly YACKBEAT ms.
+ 
+ As every waiting loop in the keyer (command mode, trainer, recording, pitch change..)
+ runs through here, the CPU is put into idle sleep while waiting if POWERSAVE is
+ configured. The heartbeat interrupt (or a pin change) wakes it up again. Timers keep
+ running in idle sleep, so the sidetone is not affected.
+ 
+ With BEATWATCH configured, the time since the beat started is taken on entry. This is
+ how long the foreground worked in this beat. If the next beat has already started, the
+ beat was overrun.
+ 
+ */
+{
+
+#ifdef BEATWATCH
+    
+    byte    pos = beatflag ? BEATCOUNTS : BEATPOS; // Overrun counts as a full beat
+    
+    if (beatfresh)
+        beatfresh = FALSE; // Time in power down or on the command key is not load
+    else
+    {
+        if (beatflag && beatlate < 0xFFFF)
+            beatlate++;
+        
+        if (pos > beatworst)
+        {
+            beatworst = pos;
+            beatwhere = (word)(uintptr_t)__builtin_return_address(0);
+        }
+    }
+    
+#endif
+
+#ifdef POWERSAVE
+    
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    
+    cli(); // Avoid missing the heartbeat between test and sleep
+    while(!beatflag) // Wait for Timeout
+    {
+        sleep_enable();
+        sei(); // The instruction after SEI is always executed, so no wakeup is lost
+        sleep_cpu();
+        sleep_disable();
+        cli();
+    }
+    sei();
+    
+#else
+    
+    while(!beatflag); // Wait for Timeout
+    
+#endif
+    
+    beatflag = FALSE; // Reset heartbeat flag
+
+#ifdef PTTOUT
+    
+    if (ptttimer && !--ptttimer) // Hang and tail time over?
+        CLEARBIT(PTTPORT,PTTPIN); // Release PTT
+    
+#endif
+
+#ifdef TELEMETRY
+    
+    if (keydown) telemetry[TELKEYDOWN]++; // Accumulate key down time
+    
+#endif
+    
+    taskrun();
+}
+
+
+
+static void taskrun(void)
+/*! 
+ @brief     Runs the background tasks that are due in this beat
+ 
+ The run time of each task is measured with the heartbeat timer and the longest one is
+ kept. Tasks are not nested: a task that waits for beats does not run other tasks.
+ 
+ This is a private function.
+ 
+ */
+{
+	static byte	busy;
+	byte		i;
+	byte		start;
+	byte		used;
+	
+	if (busy)
+		return;
+	
+	busy = TRUE;
+	
+	for (i = 0; i < TASKS; i++)
+	{
+		if (tasks[i].left && !--tasks[i].left)
+		{
+			tasks[i].left = tasks[i].period;
+			
+			start = BEATCNT;
+			tasks[i].run();
+			used = BEATCNT - start;
+			
+			if (used >= BEATCOUNTS) // Timer was cleared in between
+				used += BEATCOUNTS;
+			
+			if (used > tasks[i].worst)
+				tasks[i].worst = used;
+		}
+	}
+	
+	busy = FALSE;
+}
+
+
+
+#ifdef BEATWATCH
+
+word yackload(byte nr)
+/*! 
+ @brief     Reads the heartbeat load watch
+ 
+ @param nr  BEATWORST, BEATLATE, BEATWHERE, BEATTASK + task slot or BEATSTAGE + keyer stage
+ @return    The value, 0 if nr is out of range
+ 
+ */
+{
+	switch (nr)
+	{
+		case BEATWORST:
+			return (beatworst * (word)(F_CPU / 15625)); // Timer counts to cycles
+			
+		case BEATLATE:
+			return (beatlate);
+			
+		case BEATWHERE:
+			return (beatwhere << 1); // Byte address as in the listing
+	}
+	
+	if (nr >= BEATSTAGE)
+		return ((nr < BEATSTAGE + STAGES) ? stageworst[nr - BEATSTAGE] * (word)(F_CPU / 15625) : 0);
+	
+	return (yacktaskcycles(nr - BEATTASK));
+}
+
+#endif
+
+
+
+byte yacktask(void (*run)(void), word period)
+/*! 
+ @brief     Adds a background task or changes its period
+ 
+ Adding a task that is already there only changes its period, the next call then follows
+ a full period later. A task with a period of 0 is paused: it is not called and does not
+ wake the keyer from a TICKLESS sleep.
+ 
+ @param run     The task to call
+ @param period  Beats between calls (e.g. YACKSECS(1)), 0 to pause the task
+ @return        TRUE if all was OK, FALSE if all task slots are taken
+ 
+ */
+{
+	byte	i;
+	
+	for (i = 0; i < TASKS; i++) // Already there?
+		if (tasks[i].run == run)
+			break;
+	
+	if (i == TASKS) // No, take a free slot
+		for (i = 0; i < TASKS; i++)
+			if (!tasks[i].run)
+				break;
+	
+	if (i == TASKS)
+		return (FALSE);
+	
+	tasks[i].period = tasks[i].left = period;
+	tasks[i].run = run;
+	
+	return (TRUE);
+}
+
+
+
+word yacktaskcycles(byte nr)
+/*! 
+ @brief     Reads the longest run time of a background task
+ 
+ @param nr  Task slot, in the order the tasks were added
+ @return    Worst case CPU cycles (to 64 cycles), 0 if the slot is unused
+ 
+ */
+{
+	if (nr >= TASKS)
+		return (0);
+	
+	return (tasks[nr].worst * (word)(F_CPU / 15625)); // Timer counts to cycles
+}
+
+
+
+void yackwait(void)
+/*! 
+ @brief     Waits for the next beat in the main loop
+ 
+ Behaves like yackbeat. With TICKLESS configured and nothing going on (keyer FSM idle,
+ TX and PTT released, no serial output pending), the heartbeat timer is slowed down
+ and programmed to the earliest deadline of the active background tasks and the power down
+ timeout instead, and the CPU sleeps until then or until a paddle or the command key
+ is touched. The beats slept through are credited to the tasks and the power down
+ timer, then the 5ms heartbeat resumes. This drops idle wakeups from 200 per second
+ to one every few seconds.
+ 
+ Only the main loop may call this, as other loops count their own timeouts in beats.
+ 
+ */
+{
+
+#ifdef TICKLESS
+	
+	static word	rest;		// Remainder of slept time (64 cycle units)
+	uint32_t	sleep;		// Beats to sleep
+	word		counts;		// Slow timer counts to sleep
+	word		slept;		// Slow timer counts slept
+	byte		i;
+	
+	sleep = YACKSECS(PSTIME) - pwrtimer; // Power down deadline
+	
+	for (i = 0; i < TASKS; i++)
+		if (tasks[i].left && tasks[i].left - 1 < sleep)
+			sleep = tasks[i].left - 1; // Task deadline
+	
+	counts = (sleep * BEATCOUNTS) >> 8; // 256 fast counts in a slow one
+	if (counts > MAXIDLE) counts = MAXIDLE;
+	
+	cli();
+	
+	// A contact closed between yackiambic and here must not be slept through
+	if (!quiet || keydown || counts < 2 || YACKSECS(PSTIME) < pwrtimer
+		|| (~KEYINP & ((1<<DITPIN) | (1<<DAHPIN))) || !(BTNINP & (1<<BTNPIN))
+#ifdef PTTOUT
+		|| ptttimer
+#endif
+#ifdef SERIALOUT
+		|| serframe || serhead != sertail
+#endif
+		)
+	{
+		sei();
+		yackbeat(); // Something to do soon
+		return;
+	}
+	
+	// Slow heartbeat: prescale ck by 16384, compare just before the deadline
+	TCCR1 = (1<<CTC1) | 0b00001111;
+	OCR1C = counts - 1;
+	OCR1A = counts - 1;
+	TCNT1 = 0;
+	GTCCR |= (1<<PSR1); // Full first count
+	beatflag = FALSE;
+	
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	sei();
+	sleep_cpu(); // Until the deadline or a pin change
+	sleep_disable();
+	
+	cli();
+	slept = beatflag ? counts - 1 : TCNT1; // The compare matches as TCNT1 reaches counts - 1
+	
+	// Back to the 5ms heartbeat, starting a fresh beat now
+	TCCR1 = (1<<CTC1) | 0b00000111;
+	OCR1C = 78;
+	OCR1A = 1;
+	TCNT1 = 1; // The beat starts now, the next one a full beat later
+	GTCCR |= (1<<PSR1);
+	beatflag = FALSE;
+	sei();
+	
+	// Credit the beats slept through
+	rest += slept << 8;
+	sleep = rest / BEATCOUNTS;
+	rest -= sleep * BEATCOUNTS;
+	
+	pwrtimer += sleep;
+	
+	for (i = 0; i < TASKS; i++)
+		if (tasks[i].left)
+			tasks[i].left = (tasks[i].left > sleep) ? tasks[i].left - sleep : 1;
+	
+	quiet = FALSE;
+	taskrun(); // Tasks that are due now
+	
+#else
+	
+	yackbeat();
+	
+#endif
+	
+}
+
+
+
+void yackpitch (byte dir)
+/*! 
+ @brief     Increases or decreases the sidetone pitch
+ 
+ Changes are done not in Hz but in ctc control values. This is to avoid extensive 
+ calculations at runtime. As is all calculations are done by the preprocessor.
+ 
+ @param dir     UP or DOWN
+ 
+ */
+{
+	if (dir == UP)
+		ctcvalue--;
+	if (dir == DOWN)
+		ctcvalue++;
+	
+	if (ctcvalue < MAXCTC)
+		ctcvalue = MAXCTC;
+	
+	if (ctcvalue > MINCTC)
+		ctcvalue = MINCTC;
+	
+	volflags |= DIRTYFLAG; // Set the dirty flag	
+	
+}
+
+
+
+
+void yacktune (void)
+/*! 
+ @brief     Activates Tuning mode
+ 
+ This produces a solid keydown for TUNEDURATION seconds. After this the TX is unkeyed.
+ The same can be achieved by presing either the DIT or the DAH contact or the control key.
  
 */
 {
@@ -599,6 +1742,11 @@ void yacktoggle(byte flag)
     yackflags ^= flag;      // Toggle the feature bit
     volflags |= DIRTYFLAG;  // Set the dirty flag	
 
+#ifdef SO2R
+    if ((flag & TXINV) && !keydown)
+        keyidle(); // Both key lines follow the new polarity
+#endif
+
 }
 
 
@@ -638,6 +1786,16 @@ static void key(byte mode)
  .. but only if the corresponding functions (TXKEY and SIDETONE) have been set in
  the feature register. This function also handles a request to invert the keyer line
  if necessary (TXINV bit).
+
+ With SO2R configured, the key line of the radio in focus is used. A change of focus is
+ only applied on key up so that no element is ever split between radios.
+
+ With HWKEY configured, the TX line is not switched here but at the next heartbeat compare
+ match, so the edge falls exactly on the beat boundary.
+
+ With PTTOUT configured, the PTT line is asserted before the TX is keyed and the first
+ element is delayed by the PTT lead time. PTT is released by yackbeat once the TX has
+ been unkeyed for the hang time plus the tail time.
  
  This is a private function.
 
@@ -645,11 +1803,42 @@ static void key(byte mode)
  
  */
 {
+
+#ifdef PTTOUT
+	
+	byte	i;
+	
+#endif
 	
     if (mode == DOWN) 
     {
+
+#ifdef PTTOUT
+        
+        if (volflags & TXKEY) // Will we key the TX?
+        {
+            ptttimer = 0; // Hold PTT while keyed
+            
+            if (!(PTTPORT & (1<<PTTPIN))) // PTT not yet asserted?
+            {
+                SETBIT(PTTPORT,PTTPIN);
+                
+                for (i = pttset[PTTLEAD]; i; i--) // Let relays settle
+                    yackbeat();
+            }
+        }
+        
+#endif
+        
         if (volflags & SIDETONE) // Are we generating a Sidetone?
         {
+#ifdef HWKEY
+            OCR1C = ctcvalue;		// Then switch on the Sidetone generator
+            OCR1A = ctcvalue;
+            
+            // Toggle OC1A in CTC mode, prescale ck by 8
+            TCCR1 = (1<<CTC1) | (1<<COM1A0) | (1<<CS12);
+#else
             OCR0A = ctcvalue;		// Then switch on the Sidetone generator
             OCR0B = ctcvalue;
             
@@ -658,14 +1847,23 @@ static void key(byte mode)
             
             // Configure prescaler
             TCCR0B = 1<<CS01;
+#endif
         }
         
         if (volflags & TXKEY) // Are we keying the TX?
         {
+#ifdef HWKEY
+            // OC0A goes active at the next heartbeat compare match
+            TCCR0A = (TCCR0A & ~(1<<COM0A0)) | (1<<COM0A1) | ((yackflags & TXINV) ? 0 : (1<<COM0A0));
+#else
             if (yackflags & TXINV) // Do we need to invert keying?
-                CLEARBIT(OUTPORT,OUTPIN);
+                CLEARBIT(OUTPORT,TXPIN);
             else
-                SETBIT(OUTPORT,OUTPIN);
+                SETBIT(OUTPORT,TXPIN);
+#endif
+            
+            keydown = TRUE;
+            yackcount(TELELEMENTS);
         }
 
     }
@@ -675,37 +1873,119 @@ static void key(byte mode)
 
         if (volflags & SIDETONE) // Sidetone active?
         {
+#ifdef HWKEY
+            TCCR1 = 0;
+#else
             TCCR0A = 0;
             TCCR0B = 0;
+#endif
         }
         
         if (volflags & TXKEY) // Are we keying the TX?
         {
+#ifdef HWKEY
+            // OC0A goes idle at the next heartbeat compare match
+            TCCR0A = (TCCR0A & ~(1<<COM0A0)) | (1<<COM0A1) | ((yackflags & TXINV) ? (1<<COM0A0) : 0);
+#else
             if (yackflags & TXINV) // Do we need to invert keying?
-                SETBIT(OUTPORT,OUTPIN);
+                SETBIT(OUTPORT,TXPIN);
             else
-                CLEARBIT(OUTPORT,OUTPIN);
+                CLEARBIT(OUTPORT,TXPIN);
+#endif
+
+#ifdef PTTOUT
+            
+            ptttimer = pttset[PTTHANG] * wpmcnt + pttset[PTTTAIL] + 1; // Release after hang and tail
+            
+#endif
         }
 
+        keydown = FALSE;
+
+#ifdef SO2R
+        
+        // A change of radio only takes effect between elements
+        txpin = (radio == 2) ? KEY2PIN : OUTPIN;
+        
+        keyidle(); // The radio out of focus idles too
+        
+#endif
+
     }
     
 }
 
 
 
-void yackfarns(void)
+static void farnscalc(void)
 /*! 
- @brief     Produces an additional waiting delay for farnsworth mode.
+ @brief     Calculates the Farnsworth gap stretch
+ 
+ Farnsworth timing keeps elements at character speed and stretches the 19 gap dots of
+ PARIS so that the whole word takes exactly one minute / overall speed. The extra time
+ per gap dot is kept in 1/256 beats. It is based on the actual dot length in beats so
+ that rounding of wpmcnt does not distort the overall speed.
+ 
+ An overall speed below MINWPM switches Farnsworth timing off. Such values can only
+ come from EEPROM, e.g. a pause setting stored by an older firmware.
+ 
+ This is a private function.
  
  */
 {
+	uint32_t	gap; // Length of one stretched gap dot (1/256 beats)
 	
-    word i=farnsworth;
+	farnextra = 0;
+	farnfrac = 0;
 	
-	while (i--)
+	if (farnsworth < MINWPM) // Off, or a pause value stored by older firmware
+		farnsworth = 0;
+	
+	if (farnsworth && farnsworth < wpm)
 	{
-    	yackdelay(1);
+		gap = ((60000UL / YACKBEAT * 256) / farnsworth - (uint32_t)PARISCHR * 256 * wpmcnt) / PARISGAP;
+		farnextra = gap - 256 * wpmcnt;
 	}
+}
+
+
+
+static void farnsgap(byte n)
+/*! 
+ @brief     Stretches n gap dots for Farnsworth timing
+ 
+ Waits for the extra time of n gap dots. Fractions of a beat are carried over to the
+ next gap so that the average timing is exact.
+ 
+ This is a private function.
+ 
+ @param n   Number of gap dots to stretch
+ 
+ */
+{
+	uint32_t	t;
+	word		beats;
+	
+	t = (uint32_t)n * farnextra + farnfrac;
+	farnfrac = t & 0xFF;
+	beats = t >> 8;
+	
+	while (beats--)
+		yackbeat();
+}
+
+
+
+void yackfarns(void)
+/*! 
+ @brief     Produces an additional waiting delay for farnsworth mode.
+ 
+ Stretches an inter-character gap according to the Farnsworth overall speed.
+ 
+ */
+{
+	
+    farnsgap(ICGLEN);
 	
 }
 
@@ -772,6 +2052,42 @@ void yackplay(byte i)
 
 
 
+byte yackcode(char c)
+/*! 
+ @brief     Looks up the morse code of a character
+ 
+ The code is read from the translation table in Flash memory. Elements are stored from
+ the MSB on (1 = dah, 0 = dit) and followed by a single 1 bit that marks the end, so 
+ 0x80 is a character without elements. Digits and letters are found by their position, 
+ only other characters need a search of "morsesym".
+ 
+ @param c   The character to look up
+ @return    The encoded morse sequence, 0x80 if the character can not be translated
+ 
+*/
+{
+	byte 	i; // a counter
+	
+	if(c>='0' && c<='9') // Is it a numerical digit?
+		return pgm_read_byte(&morse[c-'0']); // Find it in the beginning of array
+    
+	if(c>='a' && c<='z') // Is it a character?
+		return pgm_read_byte(&morse[c-'a'+10]); // Find it from position 10
+	
+	if(c>='A' && c<='Z') // Is it a character in upper case?
+		return pgm_read_byte(&morse[c-'A'+10]); // Same as above
+	
+	// Last we need to handle special characters. They follow the digits and
+	// letters in the array "morsesym" (see there!)
+	for(i=MORSEALNUM;i<sizeof(morsesym);i++) // Read through the array
+		if (c == pgm_read_byte(&morsesym[i])) // Does it contain our character
+			return pgm_read_byte(&morse[i]); // Map it to morse code
+	
+	return 0x80; // 0x80 is an empty morse character (just eoc bit set)
+}
+
+
+
 void yackchar(char c)
 /*! 
  @brief     Send a character in morse code
@@ -783,6 +2099,9 @@ void yackchar(char c)
  If the character can not be translated, nothing is sent.
  
  If a space is received, an interword gap is sent.
+ 
+ Playing stops between elements when the command key is pressed, and during the
+ greeting (see yackgreet) also when a paddle is touched.
   
  @param c   The character to send
  
@@ -790,29 +2109,13 @@ void yackchar(char c)
 
 
 {
-	byte	code=0x80; // 0x80 is an empty morse character (just eoc bit set)
-	byte 	i; // a counter
-	
-	// First we need to map the actual character to the encoded morse sequence in
-	// the array "morse"
-	if(c>='0' && c<='9') // Is it a numerical digit?
-		code = pgm_read_byte(&morse[c-'0']); // Find it in the beginning of array
-    
-	if(c>='a' && c<='z') // Is it a character?
-		code = pgm_read_byte(&morse[c-'a'+10]); // Find it from position 10
-	
-	if(c>='A' && c<='Z') // Is it a character in upper case?
-		code = pgm_read_byte(&morse[c-'A'+10]); // Same as above
-	
-	// Last we need to handle special characters. There is a small char
-	// array "spechar" which contains the characters for the morse elements
-	// at the end of the "morse" array (see there!)
-	for(i=0;i<sizeof(spechar);i++) // Read through the array
-		if (c == pgm_read_byte(&spechar[i])) // Does it contain our character
-			code = pgm_read_byte(&morse[i+36]); // Map it to morse code
+	byte	code = yackcode(c);
 	
 	if(c==' ') // Do they want us to transmit a space (a gap of 7 dots)
+	{
 		yackdelay(IWGLEN-ICGLEN); // ICG was already played after previous char
+		farnsgap(IWGLEN-ICGLEN);  // Stretched ICG was also played
+	}
 	else
 	{
   		while (code != 0x80) // Stop when EOC bit has reached MSB
@@ -820,6 +2123,15 @@ void yackchar(char c)
 			if (yackctrlkey(FALSE)) // Stop playing if someone pushes key
 				return;
 			
+#if GREETWPM
+			if (padbreak) // Paddle takes over too?
+			{
+				keylatch();
+				if (volflags & (DITLATCH | DAHLATCH))
+					return;
+			}
+#endif
+			
      		if (code & 0x80) 	// MSB set ?
        			yackplay(DAH);      // ..then play a dash
      		else				// MSB cleared ?
@@ -840,6 +2152,150 @@ void yackchar(char c)
 
 
 
+static char srcnext(struct textsrc *src)
+/*! 
+ @brief     Fetches the next character from a text source
+ 
+ This is the only place that knows where text comes from. Flash and RAM strings end 
+ with a \0, EEPROM messages also end at the end of their buffer. Numbers are produced
+ digit by digit from the highest decimal place and followed by a space. History text is
+ read from the ring buffer for a given number of characters.
+ 
+ This is a private function.
+ 
+ @param src     The text source
+ @return        The next character or \0 at the end of the text
+ 
+ */
+{
+	char	c = '\0';
+	
+	switch (src->type)
+	{
+		case SRCFLASH:
+			c = pgm_read_byte(src->p++);
+			break;
+			
+		case SRCEEPROM:
+			if (src->left)
+			{
+				src->left--;
+				c = eeprom_read_byte((const byte *)src->p++);
+			}
+			break;
+			
+		case SRCRAM:
+			c = *src->p++;
+			break;
+			
+#ifdef HISTORY
+			
+		case SRCRING:
+			if (src->left)
+			{
+				src->left--;
+				c = *src->p++;
+				if (src->p == history + HISTSIZE) // Wrap around
+					src->p = history;
+			}
+			break;
+			
+#endif
+			
+		case SRCNUMBER:
+			if (src->place) // Digits left?
+			{
+				c = src->n / src->place + '0';
+				src->n %= src->place;
+				src->place /= 10;
+			}
+			else if (src->left) // Then the trailing space
+			{
+				src->left = 0;
+				c = ' ';
+			}
+			break;
+	}
+	
+	return c;
+}
+
+
+
+static void textplay(struct textsrc *src, byte origin)
+/*! 
+ @brief     Plays a text source in CW
+ 
+ The single playback engine behind all text output. Characters are fetched one at a time,
+ without copying the text. Playback stops at the end of the text or when the command key
+ is pressed. The command key press is left for the caller to handle.
+ 
+ With SO2R configured, touching the paddle stops macro playback so the operator can take
+ over, and RADIOTOKEN followed by a radio number in an EEPROM message (also when replayed)
+ switches the radio in focus.
+ 
+ This is a private function.
+ 
+ @param src     The text source
+ @param origin  MACRO if the text is to be passed on to the text output, 0 if not
+ 
+ */
+{
+	char	c;
+	
+	while ((c = srcnext(src)) && !yackctrlkey(FALSE)) // Until end of text or ctrl pressed
+	{
+
+#ifdef SO2R
+		
+		if (origin == MACRO && (!(KEYINP & (1<<DITPIN)) || !(KEYINP & (1<<DAHPIN)))) // Paddle overrides macro
+			break;
+		
+		if (src->type == SRCEEPROM && c == RADIOTOKEN) // Radio switch embedded in message
+		{
+			if (!(c = srcnext(src))) // Token ended the message
+				break;
+			
+			if (yackradio(c - '0'))
+				continue;
+			
+			// No radio number: the character is played as keyed
+		}
+		
+#endif
+		
+		if (origin)
+			textout(c, origin);
+		
+		yackchar(c); // Play the character
+	}
+}
+
+
+
+void yacksend(byte type, const char *p)
+/*! 
+ @brief     Sends a 0-terminated string in CW
+ 
+ Keys the transmitter and/or sidetone depending on feature bit settings. Playback stops
+ when the command key is pressed, which is left for the caller to handle.
+ 
+ @param type    SRCFLASH, SRCEEPROM or SRCRAM (where the string resides)
+ @param p       Pointer to the string
+ 
+ */
+{
+	struct textsrc	src;
+	
+	src.type = type;
+	src.p = p;
+	src.left = RBSIZE; // EEPROM strings never exceed a message buffer
+	
+	textplay(&src, 0);
+}
+
+
+
 void yackstring(const char *p)
 /*! 
  @brief     Sends a 0-terminated string in CW which resides in Flash
@@ -852,22 +2308,59 @@ void yackstring(const char *p)
  */
 {
 	
-	char c;
+	yacksend(SRCFLASH, p);
+	yackctrlkey(TRUE); // Abort handled here, stay in command mode
+	
+}
+
+
+
+#if GREETWPM
+
+void yackgreet(const char *p)
+/*! 
+ @brief     Plays the power on greeting
+ 
+ The greeting in Flash is played at GREETWPM instead of the stored speed, so the keyer
+ is ready soon after power up even when set to a low speed. yackchar polls the paddles
+ before every element. The first paddle contact ends the greeting and stays latched,
+ so yackiambic sends that element right away. A command key press also ends the 
+ greeting and is left for the caller to handle.
+ 
+ @param p   Pointer to string location in FLASH 
+ 
+ */
+{
+	word	savecnt = wpmcnt;
+	word	saveextra = farnextra;
+	char	c;
+	
+	wpmcnt = (1200/YACKBEAT)/GREETWPM;
+	farnextra = 0; // No Farnsworth stretch either
+	padbreak = TRUE;
 	
-	while ((c = pgm_read_byte(p++))&& !(yackctrlkey(TRUE)) )
-		// While end of string in flash not reached and ctrl not pressed
-		yackchar(c);            // Play the read character
-								// abort now if someone presses command key
+	while ((c = pgm_read_byte(p++)))
+	{
+		yackchar(c);
+		
+		if ((volflags & (DITLATCH | DAHLATCH)) || yackctrlkey(FALSE))
+			break; // Operator takes over
+	}
 	
+	padbreak = FALSE;
+	wpmcnt = savecnt;
+	farnextra = saveextra;
 }
 
+#endif
+
 
 
-void yacknumber(word n)
+void yacknumber(uint32_t n)
 /*! 
  @brief     Sends a number in CW
  
- Transforms a number up to 65535 into its digits and sends them in CW
+ Transforms a number up to 4294967295 into its digits and sends them in CW
  
  @param n   The number to send
  
@@ -875,22 +2368,17 @@ void yacknumber(word n)
 
 {
     
-    char buffer[5];
-    byte i = 0;
+	struct textsrc	src;
 	
-	while (n) // Until nothing left or control key pressed
-	{
-		buffer[i++] = n%10+'0'; // Store rest of division by 10
-		n /= 10;                // Divide by 10
-	}
+	src.type = SRCNUMBER;
+	src.n = n;
+	src.left = 1; // Trailing space
 	
-    while (i)
-    {
-		if (yackctrlkey(TRUE)) {break;}
-        yackchar(buffer[--i]);
-    }
-    
-    yackchar (' ');
+	for (src.place = 1; src.place <= n / 10; src.place *= 10) // Find the highest decimal place
+		;
+	
+	textplay(&src, 0);
+	yackctrlkey(TRUE); // Abort handled here, stay in command mode
     
 }
 
@@ -901,33 +2389,116 @@ void yacknumber(word n)
 // ***************************************************************************
 
 
-static void keylatch(void)
+static void textout(char c, byte origin)
 /*! 
- @brief     Latches the status of the DIT and DAH paddles
+ @brief     Passes a sent character on to the text output
  
- If either DIT or DAH are keyed, this function sets the corresponding bit in 
- volflags. This is used by the IAMBIC keyer to determine which element needs to 
- be sounded next.
+ Called for every character decoded from the paddle and every character played from a 
+ macro. It is remembered for replay if HISTORY is configured and counted if TELEMETRY is 
+ configured. With SERIALOUT configured, the character 
+ is queued for serial transmission, 
+ preceded by a marker if its origin differs from the previous one. Nothing is queued while
+ the sidetone is in use (e.g. in command mode) and characters are dropped if the queue is 
+ full, so the cost per character is bounded.
  
  This is a private function.
+ 
+ @param c       The character
+ @param origin  PADDLE or MACRO
+ 
+ */
+{
+	
+#ifdef HISTORY
+	
+	if (volflags & TXKEY) // Remember characters that went out on air
+	{
+		history[histhead] = c;
+		histhead = (histhead + 1) % HISTSIZE;
+		if (histcount < HISTSIZE) histcount++;
+	}
+	
+#endif
+
+#ifdef TELEMETRY
+	
+	if ((volflags & TXKEY) && c != ' ') // Count characters that went out on air
+		yackcount(TELCHARS);
+	
+#endif
+	
+#ifdef SERIALOUT
+	
+	byte	next;
+	
+	if (volflags & SIDETONE) // Serial pin busy with sidetone?
+		return;
+	
+	if (origin != serorigin) // Origin changed? Then queue marker first
+	{
+		next = (serhead + 1) & (SERQUEUE - 1);
+		if (next == sertail) return; // Queue full
+		serqueue[serhead] = (origin == MACRO) ? SERMACRO : SERPADDLE;
+		serhead = next;
+		serorigin = origin;
+	}
+	
+	next = (serhead + 1) & (SERQUEUE - 1);
+	if (next == sertail) return; // Queue full
+	serqueue[serhead] = c;
+	serhead = next;
+	
+#endif
+	
+}
 
+
+
+static byte keypaddles(void)
+/*! 
+ @brief     Reads the DIT and DAH paddles
+ 
+ This is a private function.
+ 
+ @return    DITLATCH and/or DAHLATCH for the paddles that are closed right now
+ 
  */
 {
 	
 	byte	swap;	 // Status of swap flag
+	byte	latch = 0;
 	
 	swap    = ( yackflags & PDLSWAP);
 	
 	if (!( KEYINP & (1<<DITPIN)))
-		volflags |= (swap?DAHLATCH:DITLATCH);
+		latch |= (swap?DAHLATCH:DITLATCH);
 	
 	if (!( KEYINP & (1<<DAHPIN)))
-		volflags |= (swap?DITLATCH:DAHLATCH);
+		latch |= (swap?DITLATCH:DAHLATCH);
+	
+	return latch;
 	
 }
 
 
 
+static void keylatch(void)
+/*! 
+ @brief     Latches the status of the DIT and DAH paddles
+ 
+ If either DIT or DAH are keyed, this function sets the corresponding bit in 
+ volflags. This is used by the IAMBIC keyer to determine which element needs to 
+ be sounded next.
+ 
+ This is a private function.
+
+ */
+{
+	volflags |= keypaddles();
+}
+
+
+
 byte yackctrlkey(byte mode)
 /*! 
  @brief     Scans for the Control key
@@ -987,6 +2558,10 @@ byte yackctrlkey(byte mode)
 		
         yacksave();	// In case we had a speed change	
 		
+#ifdef BEATWATCH
+        beatfresh = TRUE; // Waiting for the key is not load either
+#endif
+		
 	}
 
     volflags = volbfr; // Restore previous state
@@ -1025,11 +2600,7 @@ static char morsechar(byte buffer)
 	{
 		
 		if (pgm_read_byte(&morse[i]) == buffer)
-		{
-			if (i < 10) return ('0' + i); 		// First 10 chars are digits
-			if (i < 36) return ('A' + i - 10); 	// Then follow letters
-			return (pgm_read_byte(&spechar[i - 36])); // Then special chars
-		}
+			return (pgm_read_byte(&morsesym[i]));
 		
 	}
 	
@@ -1038,22 +2609,92 @@ static char morsechar(byte buffer)
 
 
 
+static char *msgbuffer(byte msgnr)
+/*! 
+ @brief     Maps a message number to its EEPROM buffer
+ 
+ This is a private function.
+ 
+ @param     msgnr       1 or 2 or 3 or 4
+ @return    The address of the message in EEPROM
+ 
+ */
+{
+	switch (msgnr)
+	{
+		case 1:
+			return eebuffer1;
+		case 2:
+			return eebuffer2;
+		case 3:
+			return eebuffer3;
+	}
+	
+	return eebuffer4;
+}
+
+
+
 void yackmessage(byte function, byte msgnr)
 /*! 
  @brief     Handles EEPROM stored CW messages (macros)
  
  When called in RECORD mode, the function records a message up to 100 characters and stores it in 
+ EEPROM. APPEND and REPLACE mode edit the stored message in place. See msgrecord.
+ 
+ When called in PLAY mode, the message is just played back, straight from EEPROM. Playback can 
+ be aborted using the command key.
+ 
+ @param     function    RECORD, APPEND, REPLACE or PLAY
+ @param     msgnr       1 or 2 or 3 or 4
+ 
+ */
+{
+	struct textsrc	src;				// Message to play
+	
+	if (function == PLAY)
+	{
+		yackcount(TELMACRO + msgnr - 1);
+
+#ifdef HISTORY
+		lastmsg = msgnr;
+#endif
+		
+		// Playback stops immediately if the command key is pressed.
+		src.type = SRCEEPROM;
+		src.p = msgbuffer(msgnr);
+		src.left = RBSIZE;
+		
+		textplay(&src, MACRO);
+	}
+	else
+		msgrecord(function, msgnr);
+	
+}
+
+
+
+static void msgrecord(byte function, byte msgnr)
+/*! 
+ @brief     Records or edits an EEPROM stored CW message
+ 
+ In RECORD mode, the function records a message up to 100 characters and stores it in 
  EEPROM. The routine stops recording when timing out after DEFTIMEOUT seconds. Recording
  can be aborted using the control key. If more than 100 characters are recorded, the error prosign
- is sounded and recording starts from the beginning. After recording and timing out the message is played
- back once before it is stored. To erase a message, do not key one.
+ is sounded and recording starts from the beginning. To erase a message, do not key one.
+ 
+ APPEND and REPLACE mode edit the stored message in place. APPEND records text that is added as
+ a new word at the end of the message, REPLACE records text that replaces its last word. If the
+ message would grow beyond 100 characters, the error prosign is sounded and recording of the 
+ new text starts over. Not keying anything leaves the message unchanged.
  
- When called in PLAY mode, the message is just played back. Playback can be aborted using the command
- key.
+ Only EEPROM bytes that actually change are written.
  
- @param     function    RECORD or PLAY
+ This is a private function. It is kept out of line so that its RAM buffer is only on the 
+ stack while recording, not during playback.
+ 
+ @param     function    RECORD, APPEND or REPLACE
  @param     msgnr       1 or 2 or 3 or 4
- @return    TRUE if all OK, FALSE if lock prevented message recording
  
  */
 {
@@ -1063,129 +2704,339 @@ void yackmessage(byte function, byte msgnr)
 	word			extimer = 0;		// Detects end of message (10 sec)
 	
 	byte 			i = 0;       		// Pointer into RAM buffer
-	byte 			n;					// Generic counter
+	byte			start;				// Where newly keyed text begins
 	
-	if (function == RECORD)
+	if (function != RECORD) // Editing: keep the stored message as a start
 	{
-
-		extimer = YACKSECS(DEFTIMEOUT);	// 5 Second until message end
-	   	while(extimer--)	// Continue until we waited 10 seconds
-   		{
-			if (yackctrlkey(TRUE)) return;
-			
-			if ((c = yackiambic(ON))) // Check for a character from the key
-			{
-				rambuffer[i++] = c; // Add that character to our buffer
-				extimer = YACKSECS(DEFTIMEOUT); // Reset End of message timer
-			}
-			
-			if (i>=RBSIZE) // End of buffer reached?
-			{
-				yackerror();
-				i = 0;
-			}
-			
-			yackbeat(); // 10 ms heartbeat
-		}	
+  		eeprom_read_block(rambuffer,msgbuffer(msgnr),RBSIZE);
 		
-		// Extimer has expired. Message has ended
+		while (i < RBSIZE - 1 && rambuffer[i]) // Find the end of the message
+			i++;
 		
-		if(i) // Was anything received at all?
+		if (function == REPLACE) // Go back to the start of the last word
 		{
-			rambuffer[--i] = 0; // Add a \0 end marker over last space
-			
-			// Replay the message
-			//for (n=0;n<i;n++){
-			//	if (yackctrlkey(TRUE)) {return;} //Break to command mode without saving if command key pressed
-			//	yackchar(rambuffer[n]);
-	        //    }
-			
-			// Store it in EEPROM
-			if (msgnr == 1)
-	  			eeprom_write_block(rambuffer,eebuffer1,RBSIZE);
-			if (msgnr == 2)
-	  			eeprom_write_block(rambuffer,eebuffer2,RBSIZE);
-			if (msgnr == 3)
-	  			eeprom_write_block(rambuffer,eebuffer3,RBSIZE);
-			if (msgnr == 4)
-	  			eeprom_write_block(rambuffer,eebuffer4,RBSIZE);
+			while (i && rambuffer[i-1] != ' ')
+				i--;
 		}
-		else
+		else if (i) // APPEND: Separate new text by a word gap
+			rambuffer[i++] = ' ';
+	}
+	
+	start = i;
+	
+	if (start > RBSIZE - 3) // No room for another character and its end marker
+	{
+		yackerror();
+		return;
+	}
+	
+	extimer = YACKSECS(DEFTIMEOUT);	// 5 Second until message end
+   	while(extimer--)	// Continue until we waited 10 seconds
+	{
+		if (yackctrlkey(TRUE)) return;
+		
+		if ((c = yackiambic(ON))) // Check for a character from the key
+		{
+			rambuffer[i++] = c; // Add that character to our buffer
+			extimer = YACKSECS(DEFTIMEOUT); // Reset End of message timer
+		}
+		
+		if (i>=RBSIZE) // End of buffer reached?
+		{
 			yackerror();
+			i = start;
+		}
+		
+		yackbeat(); // 10 ms heartbeat
+	}	
+	
+	// Extimer has expired. Message has ended
+	
+	if(i > start) // Was anything received at all?
+	{
+		rambuffer[--i] = 0; // Add a \0 end marker over last space
+		
+		// Store it in EEPROM. Unchanged bytes (e.g. the kept part of an edited
+		// message) are not written again.
+		eeprom_update_block(rambuffer,msgbuffer(msgnr),i+1);
+		yackcount(TELEEWRITES);
 	}
+	else
+		yackerror();
+	
+}
+
+
+
+byte yacktruncate(byte msgnr, byte pos)
+/*! 
+ @brief     Truncates an EEPROM stored CW message
+ 
+ The message is cut after pos characters. Only a single EEPROM byte is written, and
+ none at all if the message is already that short.
+ 
+ @param     msgnr       1 or 2 or 3 or 4
+ @param     pos         Number of characters to keep
+ @return    TRUE if all OK, FALSE if pos was beyond the message buffer
+ 
+ */
+{
+	char	*p = msgbuffer(msgnr);
+	byte	i;
 	
+	if (pos >= RBSIZE)
+		return (FALSE);
 	
-	if (function == PLAY)
+	for (i = 0; i < pos; i++) // Message shorter than that? Nothing to do
+		if (!eeprom_read_byte((byte *)p + i))
+			return (TRUE);
+	
+	eeprom_update_byte((byte *)p + pos, 0);
+	yackcount(TELEEWRITES);
+	
+	return (TRUE);
+}
+
+
+
+static void keypolicy(byte *lastsymbol)
+/*! 
+ @brief     Applies the keyer mode to the latched paddles
+ 
+ Part of the sampler stage of the IAMBIC keyer: it decides which of the latched paddles
+ may produce the next element, according to the keyer mode (IAMBIC A/B, ULTIMATIC or
+ DAH priority). The scheduler in yackiambic then only sends what is left in the latches.
+ New latching behaviour belongs here, which keeps element timing out of its way.
+ 
+ This is a private function.
+ 
+ @param lastsymbol  The last element sent (DITLATCH or DAHLATCH), cleared once used
+ 
+ */
+{
+    static byte ultimem = 0;    // Buffer for last keying status
+    
+    // Handle latching logic for various keyer modes
+    switch (yackflags & MODE)
+    {
+        case IAMBICA:
+        case IAMBICB:
+            // When the paddle keys are squeezed, we need to ensure that
+            // dots and dashes are alternating. To do that, whe delete
+            // any latched paddle of the same kind that we just sent.
+            // However, we only do this ONCE
+            
+            volflags &= ~*lastsymbol;
+            *lastsymbol = 0;
+            break;                    
+         
+        case ULTIMATIC:
+            // Ultimatic logic: The last paddle to be active will be repeated indefinitely
+            // In case the keyer is squeezed right out of idle mode, we just send a DAH 
+            if ((volflags & SQUEEZED) == SQUEEZED) // Squeezed?
+            {
+                if (ultimem)
+                  volflags &= ~ultimem; // Opposite symbol from last one
+                else
+                  volflags &= ~DITLATCH; // Reset the DIT latch
+            }
+            else
+            {
+                ultimem = volflags & SQUEEZED; // Remember the last single key
+            }
+
+            break;
+                    
+        case DAHPRIO:            
+            // If both paddles pressed, DAH is given priority
+            if ((volflags & SQUEEZED) == SQUEEZED)
+            {
+                volflags &= ~DITLATCH; // Reset the DIT latch
+            }
+            break;
+    }
+}
+
+
+
+static byte keydrive(void)
+/*! 
+ @brief     Output driver of the IAMBIC keyer
+ 
+ The last stage of yackiambic. It executes the element tokens queued by the scheduler
+ against key(): a key down token keys for its length in beats, a gap token just waits.
+ The next token starts in the beat the previous one ends.
+ 
+ This is a private function.
+ 
+ @return    KEYUPEVENT and/or DONEEVENT if a token ended in this beat, 0 if not
+ 
+ */
+{
+	byte	event = 0;
+	
+	if (drvstate != IDLE) // A token is running
 	{
-		// Retrieve the message from EEPROM
-		if (msgnr == 1)
-	  		eeprom_read_block(rambuffer,eebuffer1,RBSIZE);
-		if (msgnr == 2)
-	  		eeprom_read_block(rambuffer,eebuffer2,RBSIZE);
-		if (msgnr == 3)
-	  		eeprom_read_block(rambuffer,eebuffer3,RBSIZE);
-		if (msgnr == 4)
-	  		eeprom_read_block(rambuffer,eebuffer4,RBSIZE);
+		if (--drvleft)
+			return (0);
 		
-		// Replay the message
-		for (n=0;(c=rambuffer[n]);n++){ // Read until end of message
-		if (yackctrlkey(FALSE)) {return;} //Break immediately if command key pressed
-			yackchar(c); // play it back 
+		if (drvstate == KEYED)
+		{
+			key(UP);
+			event = KEYUPEVENT;
 		}
 		
+		drvstate = IDLE;
+		
+		if (tokhead == toktail) // Nothing more queued
+			return (event | DONEEVENT);
+	}
+	
+	if (tokhead != toktail) // Start the next token
+	{
+		drvleft = tokens[toktail].beats;
+		drvstate = tokens[toktail].mark ? KEYED : IEG;
+		toktail = (toktail + 1) & (TOKENS - 1);
+		
+		if (drvstate == KEYED)
+			key(DOWN); // Switch on the side tone and TX
 	}
 	
+	return (event);
+}
+
+
+
+static void tokput(byte mark, byte beats)
+/*! 
+ @brief     Queues an element token for the output driver
+ 
+ The scheduler only queues while the driver is idle, so the ring never overflows.
+ 
+ This is a private function.
+ 
+ @param mark    TRUE for key down, FALSE for a gap
+ @param beats   Length of the token
+ 
+ */
+{
+	tokens[tokhead].mark = mark;
+	tokens[tokhead].beats = beats;
+	tokhead = (tokhead + 1) & (TOKENS - 1);
+}
+
+
+
+#ifdef BEATWATCH
+
+static void stagetime(byte stage, byte *start)
+/*! 
+ @brief     Notes the run time of a keyer stage
+ 
+ Keeps the worst case per stage and restarts the measurement for the next stage.
+ Nothing is noted right after a power down.
+ 
+ This is a private function.
+ 
+ @param stage   STAGESAMPLE, STAGESCHEDULE or STAGEDRIVE
+ @param start   Heartbeat timer when the stage started, set to now on return
+ 
+ */
+{
+	byte	used = BEATCNT - *start;
+	
+	if (used >= BEATCOUNTS) // Timer was cleared in between
+		used += BEATCOUNTS;
+	
+	if (!beatfresh && used > stageworst[stage])
+		stageworst[stage] = used;
+	
+	*start = BEATCNT;
 }
 
+#endif
 
 
 
 char yackiambic(byte ctrl)
 /*! 
- @brief     Finite state machine for the IAMBIC keyer
+ @brief     IAMBIC keyer
  
  If IAMBIC (squeeze) keying is requested, this routine, which usually terminates
  immediately needs to be called in regular intervals of YACKBEAT milliseconds.
  
  This can happen though an outside busy waiting loop or a counter mechanism.
  
+ Every call runs three stages in turn. The sampler latches the paddles as far as the
+ running token allows and applies the keyer mode (keypolicy). The scheduler decodes
+ characters and word gaps and, while the driver is idle, turns the latches into element
+ tokens (key down and gap, with their length in beats). The output driver (keydrive)
+ executes the tokens against key(). All stages run in the same beat, so the timeline is
+ that of a single state machine. With BEATWATCH configured, the worst run time of each
+ stage is kept.
+ 
  @param ctrl    ON if the keyer should recognize when a word ends. OFF if not.
  @return        The character if one was recognized, /0 if not
  
  */
 {
 	
-	static enum FSMSTATE	fsms = IDLE;	// FSM state indicator
-	static 		word		timer;			// A countdown timer
+	static 		word		timer;			// Character and word gap countdown
 	static		byte		lastsymbol;		// The last symbol sent
 	static		byte		buffer = 0;		// A place to store a sent char
 	static		byte		bcntr = 0;		// Number of elements sent
 	static		byte		iwgflag = 0;	// Flag: Are we in interword gap?
-    static      byte        ultimem = 0;    // Buffer for last keying status
-				char		retchar;		// The character to return to caller
-	
-	// This routine is called every YACKBEAT ms. It starts with idle mode where
-	// the morse key is polled. Once a contact close is sensed, the TX key is 
-	// closed, the sidetone oscillator is fired up and the FSM progresses
-	// to the next state (KEYED). There it waits for the timer to expire, 
-	// afterwards progressing to IEG (Inter Element Gap).
-	// Once the IEG has completed, processing returns to the IDLE state.
-	
-	// If the FSM remains in idle state long enough (one dash time), the
+	static		byte		lastctrl = OFF;	// ctrl of the previous call
+#if defined(ADAPTIVE) || defined(ANALYZER)
+	static		word		gapcnt = 0xFFFF; // Beats since the last key up
+#endif
+#ifdef ANALYZER
+	static		word		gapthr;			// Beats from key up that end a character
+	static		byte		squeeze;		// Opposite paddle seen in this element
+	static		byte		nearflag;		// Current character has a gap near gapthr
+				byte		bin;			// Gap length in dots
+#endif
+#ifdef BEATWATCH
+				byte		start = BEATCNT; // Start of the current stage
+#endif
+				enum FSMSTATE state = drvstate; // Token running as the beat starts
+				char		retchar = '\0';	// The character to return to caller
+				byte		event;			// What the driver did
+	
+	// This routine is called every YACKBEAT ms. While the driver is idle, the 
+	// morse key is polled. Once a contact close is sensed, a key down token
+	// and a gap token are queued and the driver keys the TX and fires up the
+	// sidetone oscillator in the same beat. The paddles are latched as the
+	// mode allows while the tokens run. Once the gap has ended, the scheduler
+	// takes over again.
+	
+	// If the driver remains idle long enough (one dash time), the
 	// character is assumed to be complete and a decoding is attempted. If
 	// succesful, the ascii code of the character is returned to the caller
 	
-	// If the FSM remains in idle state for another 4 dot times (7 dot times 
+	// If the driver remains idle for another 4 dot times (7 dot times 
 	// altogether), we assume that the word has ended. A space char
 	// is transmitted in this case.
 	
 	if (timer) timer--; // Count down
 	
-	if (ctrl == OFF) iwgflag = 0; // No space detection
+	// A word gap pending from a caller that did not want spaces must not reach
+	// the next one as a leading space
+	if (ctrl != OFF && lastctrl == OFF) iwgflag = 0;
+	lastctrl = ctrl;
+	
+#ifdef TICKLESS
+	quiet = FALSE;
+#endif
+	
+#if defined(ADAPTIVE) || defined(ANALYZER)
+	if (state != KEYED && gapcnt < 0xFFFF) gapcnt++; // Measure the current gap
+#endif
+	
+	// Stage 1: Sampler
 	
-	switch (fsms)
+	switch (state)
 	{
-			
 		case IDLE:
 			
 			keylatch();
@@ -1196,137 +3047,177 @@ char yackiambic(byte ctrl)
 
 #endif            
             
-            // Handle latching logic for various keyer modes
-            switch (yackflags & MODE)
-            {
-                case IAMBICA:
-                case IAMBICB:
-                    // When the paddle keys are squeezed, we need to ensure that
-                    // dots and dashes are alternating. To do that, whe delete
-                    // any latched paddle of the same kind that we just sent.
-                    // However, we only do this ONCE
-                    
-                    volflags &= ~lastsymbol;
-                    lastsymbol = 0;
-                    break;                    
-                 
-                case ULTIMATIC:
-                    // Ultimatic logic: The last paddle to be active will be repeated indefinitely
-                    // In case the keyer is squeezed right out of idle mode, we just send a DAH 
-                    if ((volflags & SQUEEZED) == SQUEEZED) // Squeezed?
-                    {
-                        if (ultimem)
-                          volflags &= ~ultimem; // Opposite symbol from last one
-                        else
-                          volflags &= ~DITLATCH; // Reset the DIT latch
-                    }
-                    else
-                    {
-                        ultimem = volflags & SQUEEZED; // Remember the last single key
-                    }
-
-                    break;
-                            
-                case DAHPRIO:            
-                    // If both paddles pressed, DAH is given priority
-                    if ((volflags & SQUEEZED) == SQUEEZED)
-                    {
-                        volflags &= ~DITLATCH; // Reset the DIT latch
-                    }
-                    break;
-            }        
-            
+            keypolicy(&lastsymbol); // Apply the keyer mode to the latches
+			break;
+			
+		case KEYED:
+
+#ifdef POWERSAVE
+ 			
+            yackpower(FALSE); // can not go to sleep when keyed
+
+#endif
             
-			// The following handles the inter-character gap. When there are
-			// three (default) dot lengths of space after an element, the
-			// character is complete and can be returned to caller
-			if (timer == 0 && bcntr != 0) // Have we idled for 3 dots
-				// and is there something to decode?
+			if ((yackflags & MODE) == IAMBICB) // If we are in IAMBIC B mode
+				keylatch();                      // then latch here already 
+			
+#ifdef ANALYZER
+			if (!squeeze && (keypaddles() & ~lastsymbol)) // Opposite paddle closed
 			{
-				buffer = buffer << 1;	  // Make space for the termination bit
-				buffer |= 1;			  // The 1 on the right signals end
-				buffer = buffer << (7-bcntr); // Shift to left justify
-				retchar = morsechar(buffer); // Attempt decoding
-				buffer = bcntr = 0;			// Clear buffer
-				timer = (IWGLEN - ICGLEN) * wpmcnt;	// If 4 further dots of gap,
-				// this might be a Word gap.
-				iwgflag = 1;                // Signal we are waiting for IWG                          
-				return (retchar);			// and return decoded char
+				squeeze = 1;
+				analyze(ANAEARLY);
 			}
+#endif
+			break;
 			
+		case IEG:
+			
+			keylatch();	// Latch any paddle movements (both A and B)
+			
+#ifdef ANALYZER
+			if (!squeeze && (volflags & (DITLATCH | DAHLATCH) & ~lastsymbol))
+			{
+				squeeze = 1;
+				analyze(ANALATE);
+			}
+#endif
+			break;
+	}
+	
+#ifdef BEATWATCH
+	stagetime(STAGESAMPLE, &start);
+#endif
+	
+	// Stage 2: Scheduler
+	
+	if (state == IDLE)
+	{
+		// The following handles the inter-character gap. When there are
+		// three (default) dot lengths of space after an element, the
+		// character is complete and can be returned to caller
+		if (timer == 0 && bcntr != 0) // Have we idled for 3 dots
+			// and is there something to decode?
+		{
+			buffer = buffer << 1;	  // Make space for the termination bit
+			buffer |= 1;			  // The 1 on the right signals end
+			buffer = buffer << (7-bcntr); // Shift to left justify
+			retchar = morsechar(buffer); // Attempt decoding
+			if (retchar) textout(retchar, PADDLE);
+#ifdef ANALYZER
+			analyze(ANACHARS);
+			if (nearflag) analyze(ANANEAR);
+			nearflag = 0;
+#endif
+			buffer = bcntr = 0;			// Clear buffer
+			timer = (IWGLEN - ICGLEN) * wpmcnt;	// If 4 further dots of gap,
+			// this might be a Word gap.
+			iwgflag = 1;                // Signal we are waiting for IWG                          
+		}
+		else
+		{
 			// This handles the Inter-word gap. Already 3 dots have been
 			// waited for, if 4 more follow, interpret this as a word end
 			if (timer == 0 && iwgflag) // Have we idled for 4+3 = 7 dots?
 			{
 				iwgflag = 0;   // Clear Interword Gap flag
-				return (' ');  // And return a space
+				textout(' ', PADDLE); // Word gaps are always logged..
+				if (ctrl != OFF)
+					retchar = ' ';  // ..but only returned if requested
 			}
 			
 			// Now evaluate the latch and determine what to send next
-			if ( volflags & (DITLATCH | DAHLATCH)) // Anything in the latch?
+			if (retchar)
+				;
+			else if ( volflags & (DITLATCH | DAHLATCH)) // Anything in the latch?
 			{
+#ifdef ADAPTIVE
+				// The gap that just ended tells us something about the operator's
+				// spacing: within a character it was an inter-element gap, after a
+				// decoded character (but before the word gap) an inter-character gap.
+				if (bcntr)
+					gaplearn(gapcnt, &iegest, MINIEG, MAXIEG);
+				else if (iwgflag)
+					gaplearn(gapcnt, &icgest, MINICG, MAXICG);
+#endif
+#ifdef ANALYZER
+				// Sort the gap that just ended into a bin of whole dots and note if it
+				// came close to being read the other way (char end or no char end).
+				bin = (gapcnt < 7 * wpmcnt) ? (gapcnt + (wpmcnt >> 1)) / wpmcnt : 7;
+				if (bin < 1) bin = 1;
+				analyze(ANAGAPS + bin);
+				
+				if (gapcnt + (wpmcnt >> 1) > gapthr && gapcnt < gapthr + (wpmcnt >> 1))
+					nearflag = 1;
+#endif
 				iwgflag = 0; // No interword gap if dit or dah
                 bcntr++;	// Count that we will send something now
 				buffer = buffer << 1; // Make space for the new character
 				
 				if (volflags & DITLATCH) // Is it a dit?
 				{
-					timer	= DITLEN * wpmcnt; // Duration = one dot time
+					tokput(TRUE, DITLEN * wpmcnt); // Duration = one dot time
 					lastsymbol = DITLATCH; // Remember what we sent
 				}
 				else // must be a DAH then..
 				{
-					timer	= DAHLEN * wpmcnt; // Duration = one dash time
+					tokput(TRUE, DAHLEN * wpmcnt); // Duration = one dash time
 					lastsymbol = DAHLATCH; // Remember
 					buffer |= 1; // set LSB to remember dash
 				}
 				
-				key(DOWN); // Switch on the side tone and TX
-				volflags &= ~(DITLATCH | DAHLATCH); // Reset both latches
+				tokput(FALSE, IEGLEN * wpmcnt); // One dot time for the gap
 				
-				fsms 	= KEYED; // Change FSM state
-			}
-			
-			break;
-			
-		case KEYED:
-
-#ifdef POWERSAVE
- 			
-            yackpower(FALSE); // can not go to sleep when keyed
-
+				volflags &= ~(DITLATCH | DAHLATCH); // Reset both latches
+#ifdef ANALYZER
+				analyze(ANAELEMENTS);
+				squeeze = 0;
 #endif
-            
-			if ((yackflags & MODE) == IAMBICB) // If we are in IAMBIC B mode
-				keylatch();                      // then latch here already 
-			
-			if(timer == 0) // Done with sounding our element?
-			{
-				key(UP); // Then cancel the side tone
-				timer	= IEGLEN * wpmcnt; // One dot time for the gap
-				fsms	= IEG; // Change FSM state
 			}
-			
-			break;
-			
-			
-		case IEG:
-			
-			keylatch();	// Latch any paddle movements (both A and B)
-			
-			if(timer == 0) // End of gap reached?
+#ifdef TICKLESS
+			else if (!timer && !bcntr && !iwgflag) // Nothing to key, decode or wait for
 			{
-				fsms	= IDLE; // Change FSM state
-				// The following timer determines what the IDLE state
-                // accepts as character. Anything longer than 2 dots as gap will be
-                // accepted for a character end.
-				timer	= (ICGLEN - IEGLEN -1) * wpmcnt; 
+				quiet = TRUE;
 			}
-			break;
-			
+#endif
+		}
+	}
+	
+#ifdef BEATWATCH
+	stagetime(STAGESCHEDULE, &start);
+#endif
+	
+	// Stage 3: Output driver
+	
+	event = keydrive();
+	
+#if defined(ADAPTIVE) || defined(ANALYZER)
+	if (event & KEYUPEVENT)
+		gapcnt	= 0; // Start measuring the gap
+#endif
+	
+	if (event & DONEEVENT) // End of gap reached? Back to the scheduler
+	{
+		// The following timer determines what the scheduler
+		// accepts as character. Anything longer than 2 dots as gap will be
+		// accepted for a character end.
+#ifdef ADAPTIVE
+		// With adaptive decoding the end of character lies halfway between
+		// the learned inter-element and inter-character gaps instead.
+		timer	= (((iegest + icgest) >> 1) * wpmcnt) >> 3; // Threshold in beats
+		timer	= (timer > gapcnt) ? timer - gapcnt : 1; // IEG already passed
+#else
+		timer	= (ICGLEN - IEGLEN -1) * wpmcnt; 
+#endif
+#ifdef ANALYZER
+		gapthr	= gapcnt + timer; // Where this gap would end the character
+#endif
 	}
 	
-	return '\0'; // Nothing to return if not returned in above routine
+#ifdef BEATWATCH
+	stagetime(STAGEDRIVE, &start);
+#endif
+	
+	return (retchar);
 	
 }
 
@@ -34,12 +34,23 @@
 #define		OUTPORT			PORTB
 #define		OUTPIN			0
 
+// Definition of where the key line of the second radio is connected (only with SO2R, see
+// below). It must be on the same port as OUTPIN. PB5 needs the reset pin disabled by fuse.
+#define		KEY2PIN			5
+
 // Definition of where the sidetone output is connected (beware,
 // this is chip dependent and can not just be changed at will)
 #define		STDDR			DDRB
 #define		STPORT			PORTB
 #define		STPIN			1
 
+// Definition of where the PTT output is connected (only with PTTOUT, see below). PB5 is 
+// only usable as an output once the reset pin has been disabled by fuse (RSTDISBL), after
+// which the chip can no longer be programmed by ISP.
+#define		PTTDDR			DDRB
+#define		PTTPORT			PORTB
+#define		PTTPIN			5
+
 // Definition of where the control button is connected
 #define		BTNDDR			DDRB
 #define		BTNPORT			PORTB
@@ -83,21 +94,142 @@
 #define		YACKBEAT		5
 #define		YACKSECS(n)		(n*(1000/YACKBEAT)) // Beats in n seconds (off by 2x for 5ms heartbeat)
 #define		YACKMS(n)		(n/YACKBEAT) // Beats in n milliseconds
+#define     BEATCOUNTS      79  // Heartbeat timer counts per beat (64 cycles each)
+
+// Background tasks. Each task is called by yackbeat in its own interval of beats, whatever
+// the foreground is doing at the time. Tasks must finish quickly and not wait for beats.
+#define     TASKS           2   // Number of task slots
 
 // Power save mode
 #define     POWERSAVE       // Comment this line if no power save mode required
 #define     PSTIME          30 // 30 seconds until automatic powerdown
 #define     PWRWAKE         ((1<<PCINT3) | (1<<PCINT4) | (1<<PCINT2)) // Dit, Dah or Command wakes us up..
 
+// Tickless idle (needs POWERSAVE). While the keyer is completely idle, the main loop sleeps
+// through the heartbeats up to the next deadline (background task or power down), at most
+// for MAXIDLE heartbeat timer counts of the slow prescaler (16.384ms each). A pin change 
+// wakes it up at once. Not available with HWKEY, whose 8 bit heartbeat timer lacks the 
+// slow prescaler.
+//#define     TICKLESS        // Uncomment this line to sleep through idle heartbeats
+#define     MAXIDLE         244 // About 4 seconds
+
+#if defined(TICKLESS) && (!defined(POWERSAVE) || defined(HWKEY))
+#error "TICKLESS needs POWERSAVE and can not be combined with HWKEY"
+#endif
+
+// Serial text output. Every character decoded from the paddle or played from a macro is sent
+// as 8N1 serial data at one bit per heartbeat (200 Baud at 5ms) on the sidetone pin, but only
+// while the sidetone is switched off. A marker character is sent whenever the origin changes.
+//#define     SERIALOUT       // Uncomment this line to enable serial text output
+#define     SERPORT         STPORT
+#define     SERPIN          STPIN
+#define     SERQUEUE        16      // Size of the transmit queue (must be a power of 2)
+#define     SERPADDLE       '}'     // Marker for text keyed on the paddle
+#define     SERMACRO        '{'     // Marker for text played from a macro
+
+// Lifetime usage counters. They are kept in RAM and written to EEPROM on every TELFLUSH-th
+// power down and when a counter is queried. Only bytes that changed are written.
+//#define     TELEMETRY       // Uncomment this line to enable usage counters
+#define     TELFLUSH        16  // Power downs between writes of the counters
+
+#define     TELKEYDOWN      0   // Key down time (heartbeats)
+#define     TELELEMENTS     1   // Elements sent
+#define     TELCHARS        2   // Characters sent
+#define     TELMACRO        3   // Macro plays, one counter per message (3 to 6)
+#define     TELCMDMODE      7   // Command mode entries
+#define     TELPWRDOWN      8   // Power down cycles
+#define     TELEEWRITES     9   // EEPROM writes issued
+#define     TELCOUNT        10  // Number of counters
+
+// Settings store. Small settings are appended as key/value records to a log in EEPROM,
+// so a new setting only needs a key here. Keys run from 1 to KVKEYS-1, KVWORD in the key 
+// marks a 16 bit value (a byte otherwise). KVKEYS bytes of RAM index the log.
+#define     KVSIZE          32  // Bytes of EEPROM for the log
+#define     KVKEYS          4   // Highest key + 1
+#define     KVWORD          0x40 // Key flag: value is a word
+#define     KVEND           0xFF // Free space in the log
+
+#define     KVBEACON        (1 | KVWORD) // Beacon interval in seconds
+
+// Paddle timing analysis. Statistics about the operator's paddle timing are collected in
+// RAM since power up and can be queried in command mode to find out why characters are
+// decoded wrong and to tune the decoding and latching settings.
+//#define     ANALYZER        // Uncomment this line to enable the timing analysis
+
+#define     ANAELEMENTS     0   // Elements keyed with the paddle
+#define     ANAGAPS         0   // Gaps of 1 to 7+ dots (1 to 7)
+#define     ANACHARS        8   // Characters decoded
+#define     ANANEAR         9   // Characters with a gap near the character threshold
+#define     ANAEARLY        10  // Squeezes while the element sounded
+#define     ANALATE         11  // Squeezes in the gap after the element
+#define     ANACOUNT        12  // Number of statistics
+
+// Heartbeat load watch. yackbeat notes how far into the beat the foreground work had got
+// when it was called again, keeps the worst case and where it was called from, and counts 
+// the beats that were overrun altogether.
+//#define     BEATWATCH       // Uncomment this line to watch the heartbeat load
+
+#define     BEATWORST       0   // Worst foreground time in a beat (cycles)
+#define     BEATLATE        1   // Beats overrun
+#define     BEATWHERE       2   // Flash address yackbeat was called from in the worst beat
+#define     BEATTASK        3   // Worst run time of each background task (3 and up, cycles)
+#define     BEATSTAGE       (BEATTASK + TASKS) // Worst run time of each keyer stage (cycles)
+
+#define     STAGESAMPLE     0   // Keyer stage: paddle sampler
+#define     STAGESCHEDULE   1   // Keyer stage: element scheduler
+#define     STAGEDRIVE      2   // Keyer stage: output driver
+#define     STAGES          3   // Number of keyer stages
+
+// PTT sequencing. PTT is asserted before the first element, which is delayed by the lead
+// time, and released once the TX was unkeyed for the hang time (in dots, so it follows the
+// speed) plus the tail time.
+//#define     PTTOUT          // Uncomment this line to enable the PTT output
+#define     PTTLEAD         0   // Index of PTT lead time
+#define     PTTTAIL         1   // Index of PTT tail time
+#define     PTTHANG         2   // Index of PTT hang time
+#define     DEFLEAD         YACKMS(25)  // Default lead time (beats)
+#define     DEFTAIL         YACKMS(50)  // Default tail time (beats)
+#define     DEFHANG         IWGLEN      // Default hang time (dots)
+
+// SO2R (single operator, two radios). A second key line is provided and macros and paddle
+// key the radio in focus. Touching the paddle stops a macro. In a macro, RADIOTOKEN followed
+// by 1 or 2 moves the focus.
+//#define     SO2R            // Uncomment this line to enable the second key line
+#define     RADIOTOKEN      '|' // Paragraph break (.-.-..) in a macro switches radio
+
+#if defined(SO2R) && defined(PTTOUT) && (KEY2PIN == PTTPIN)
+#error "SO2R and PTTOUT can not share a pin"
+#endif
+
+// Hardware keying. The heartbeat moves to Timer0 and the sidetone to Timer1 (OC1A is also
+// PB1). The TX line on OUTPIN (OC0A) is then switched by the compare match that ends the 
+// heartbeat, so key edges fall exactly on beat boundaries no matter how busy the CPU is.
+// They lag the sidetone by one beat. OUTPIN must stay on PB0 for this.
+//#define     HWKEY           // Uncomment this line to key the TX by timer hardware
+
+#if defined(HWKEY) && defined(SO2R)
+#error "HWKEY can only key OUTPIN, not the second radio of SO2R"
+#endif
+
+// History of sent text. The last HISTSIZE characters sent on air (paddle and messages) are
+// kept in RAM so that the last word, the last few characters or the last message can be
+// sent again on request. 32 characters hold a callsign and exchange comfortably and leave
+// enough of the 512 Byte RAM for the 100 Byte message recording buffer on the stack.
+//#define     HISTORY         // Uncomment this line to enable replay of sent text
+#define     HISTSIZE        32  // Characters kept
+
 // These values limit the speed that the keyer can be set to
 #define		MAXWPM			50  
 #define		MINWPM			5
 #define		DEFWPM			15
 
-// Farnsworth parameters
+// Farnsworth parameters. Farnsworth timing is set as an overall speed in WPM below the
+// character speed. Character and word gaps are stretched so that the standard word PARIS
+// takes exactly as long as at the overall speed.
 #define     FARNSWORTH      1
 #define     WPMSPEED        0
-#define     MAXFARN         255
+#define     PARISCHR        31  // Dots in PARIS spent in elements and inter-element gaps
+#define     PARISGAP        19  // Dots in PARIS spent in character and word gaps
 
 #define		WPMCALC(n)		((1200/YACKBEAT)/n) // Calculates number of beats in a dot 
 
@@ -107,9 +239,19 @@
 #define		ICGLEN			3	// Length of inter-character gap
 #define		IWGLEN			7	// Length of inter-word gap
 
+// Adaptive decoding. The keyer learns the operator's inter-element and inter-character gaps
+// and places the end-of-character threshold between the two. Estimates are kept in 1/8 dots.
+//#define     ADAPTIVE        // Uncomment this line to enable adaptive decode thresholds
+#define     GAPSHIFT        3   // Estimates follow each new gap by 1/(2^GAPSHIFT)
+#define     MINIEG          4   // Inter-element gap estimate limits (1/8 dots)
+#define     MAXIEG          16
+#define     MINICG          16  // Inter-character gap estimate limits (1/8 dots)
+#define     MAXICG          48
+
 // Duration of various internal timings in seconds
 #define		TUNEDURATION	20  // Duration of tuning keydown (in seconds)
 #define     DEFTIMEOUT      5   // Default timeout 5 seconds
+#define     GREETWPM        30  // Speed of the power on greeting (0 = no greeting)
 #define     MACTIMEOUT      15  // Timeout after playing back a macro
 
 // The following defines various parameters in relation to the pitch of the sidetone
@@ -131,6 +273,7 @@
 
 // The following are various definitions in use throughout the program
 #define		RBSIZE			100     // Size of each of the four EEPROM buffers
+#define		PROFILES		4       // Number of stored operator profiles
 
 #define		MAGPAT			0xA5    // If this number is found in EEPROM, content assumed valid
 
@@ -145,10 +288,25 @@
 
 #define		RECORD			1
 #define		PLAY			2
+#define		APPEND			3
+#define		REPLACE			4
 
 #define		READ			1
 #define		WRITE			2
 
+#define		PADDLE			1
+#define		MACRO			2
+
+#define		SRCFLASH		1       // Text sources (see yacksend)
+#define		SRCEEPROM		2
+#define		SRCRAM			3
+#define		SRCNUMBER		4
+#define		SRCRING			5
+
+#define		LASTWORD		1       // What to replay (see yackreplay)
+#define		LASTCHARS		2
+#define		LASTMSG			3
+
 #define		TRUE            1
 #define		FALSE           0
 
@@ -163,8 +321,10 @@ typedef		uint16_t        word;
 
 // Forward declarations of public functions
 void        yackinit (void);
+byte        yackcode(char c);
 void        yackchar(char c);
 void        yackstring(const char *p);
+void        yacksend(byte type, const char *p);
 char        yackiambic(byte ctrl);
 void        yackpitch (uint8_t dir);
 void        yacktune (void);
@@ -174,22 +334,62 @@ void        yackerror (void);
 void        yacktoggle(byte flag);
 byte        yackflag(byte flag);
 void        yackbeat(void);
+void        yackwait(void);
 void        yackmessage(byte function, byte msgnr);
+byte        yacktruncate(byte msgnr, byte pos);
 void        yacksave (void);
 byte        yackctrlkey(byte mode);
 void        yackreset (void);
-word        yackuser (byte func, byte nr, word content);
-void        yacknumber(word n);
+#ifdef BEATWATCH
+word        yackload(byte nr);
+#endif
+byte        yacktask(void (*run)(void), word period);
+word        yacktaskcycles(byte nr);
+word        yackget(byte key);
+void        yackset(byte key, word value);
+void        yacknumber(uint32_t n);
+#if GREETWPM
+void        yackgreet(const char *p);
+#endif
 word        yackwpm(void);
 void        yackplay(byte i);
 void        yackdelay(byte n);
 void        yackfarns(void);
 void        yackspeed (byte dir, byte mode);
+byte        yackprofile (byte func, byte nr);
+
+#ifdef ADAPTIVE
+void        yackgaps(void);
+#endif
 
 #ifdef POWERSAVE
 void        yackpower(byte n);
 #endif
 
+#ifdef PTTOUT
+byte        yackptt(byte param, word value);
+#endif
+
+#ifdef HISTORY
+byte        yackreplay(byte what, byte n);
+#endif
+
+#ifdef SO2R
+byte        yackradio(byte nr);
+#endif
+
+#ifdef ANALYZER
+word        yackstats(byte nr);
+#endif
+
+#ifdef TELEMETRY
+void        yackcount(byte nr);
+uint32_t    yackcounter(byte nr);
+void        yackcountsave(void);
+#else
+#define     yackcount(nr)   // Counting compiles to nothing
+#endif
+
 
 
 